@@ -0,0 +1,476 @@
+/**
+ * Throughput benchmarks of lpcre2.
+ *
+ * Every case runs in a fresh Lua state whose allocator counts allocations.
+ * Since PCRE2 memory also goes through the Lua allocator, allocs/op and
+ * bytes/op include both Lua and PCRE2 allocations.
+ *
+ * Usage: lpcre2_bench [--json] [--time SECONDS] [FILTER...]
+ */
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+#include "pcre2.lua.h"
+
+/**
+ * @brief Allocation counters of a Lua state.
+ */
+typedef struct bench_alloc
+{
+    size_t count;
+    size_t bytes;
+} bench_alloc_t;
+
+/**
+ * @brief A benchmark case.
+ *
+ * #setup is a Lua chunk run once, which defines globals such as `code` and
+ * `subject`. Each operation is then either the Lua statement #body (with the
+ * iteration number `i`), or one iteration of #run.
+ */
+typedef struct bench_case
+{
+    const char* name;
+    const char* setup;
+    const char* body;
+    void (*run)(lua_State* L, size_t n);
+} bench_case_t;
+
+typedef struct bench_result
+{
+    size_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+} bench_result_t;
+
+static void* _bench_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    bench_alloc_t* alloc = ud;
+    (void)osize;
+
+    if (nsize == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    alloc->count++;
+    alloc->bytes += nsize;
+    return realloc(ptr, nsize);
+}
+
+#if defined(_WIN32)
+
+static double _bench_now(void)
+{
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double)count.QuadPart * 1e9 / (double)freq.QuadPart;
+}
+
+#else
+
+static double _bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+#endif
+
+static lpcre2_code_t* _bench_global_code(lua_State* L)
+{
+    lua_getglobal(L, "code");
+    lpcre2_code_t* code = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return code;
+}
+
+static const char* _bench_global_string(lua_State* L, const char* name, size_t* len)
+{
+    /* Globals keep the string alive. */
+    lua_getglobal(L, name);
+    const char* str = lua_tolstring(L, -1, len);
+    lua_pop(L, 1);
+    return str;
+}
+
+static void _bench_c_match(lua_State* L, size_t n)
+{
+    size_t i, len;
+    lpcre2_code_t* code = _bench_global_code(L);
+    const char* subject = _bench_global_string(L, "subject", &len);
+    int top = lua_gettop(L);
+
+    for (i = 0; i < n; i++)
+    {
+        lpcre2_match(L, code, subject, len, 0, 0);
+        lua_settop(L, top);
+    }
+}
+
+static void _bench_c_match_into(lua_State* L, size_t n)
+{
+    size_t i, len;
+    lpcre2_code_t* code = _bench_global_code(L);
+    const char* subject = _bench_global_string(L, "subject", &len);
+    lpcre2_match_data_t* match_data = lpcre2_match_data_create(L, code);
+
+    for (i = 0; i < n; i++)
+    {
+        lpcre2_match_into(L, code, subject, len, 0, 0, match_data);
+    }
+
+    lua_pop(L, 1);
+}
+
+static void _bench_c_substitute(lua_State* L, size_t n)
+{
+    size_t i, len, out_len;
+    lpcre2_code_t* code = _bench_global_code(L);
+    const char* subject = _bench_global_string(L, "subject", &len);
+    int top = lua_gettop(L);
+
+    for (i = 0; i < n; i++)
+    {
+        lpcre2_substitute(L, code, subject, len, "_", 1,
+            LPCRE2_SUBSTITUTE_GLOBAL, &out_len);
+        lua_settop(L, top);
+    }
+}
+
+#define BENCH_SHORT     "subject = 'order 1234-5678 shipped'" "\n"
+#define BENCH_LONG      "subject = string.rep('lorem ipsum dolor ', 4096) .. 'id=42;'" "\n"
+#define BENCH_TEXT      "subject = string.rep('the quick  brown fox\\tjumps ', 160)" "\n"
+#define BENCH_PATTERNS  \
+    "patterns = {}" "\n" \
+    "for i = 1, 128 do patterns[i] = '(\\\\w+)-' .. i .. '-(\\\\d{2,' .. (i % 7 + 2) .. '})' end" "\n"
+
+static const bench_case_t s_bench_cases[] = {
+    {
+        "match/short/jit",
+        BENCH_SHORT "code = lpcre2.compile('(\\\\d+)-(\\\\d+)')",
+        "code:match(subject)", NULL,
+    },
+    {
+        "match/short/interp",
+        BENCH_SHORT "code = lpcre2.compile('(\\\\d+)-(\\\\d+)', 0, 0)",
+        "code:match(subject)", NULL,
+    },
+    {
+        "match/short/reuse_match_data",
+        BENCH_SHORT "code = lpcre2.compile('(\\\\d+)-(\\\\d+)') md = code:new_match_data()",
+        "code:match(subject, 0, 0, md)", NULL,
+    },
+    {
+        "match/long/jit",
+        BENCH_LONG "code = lpcre2.compile('id=(\\\\d+);')",
+        "code:match(subject)", NULL,
+    },
+    {
+        "match/long/interp",
+        BENCH_LONG "code = lpcre2.compile('id=(\\\\d+);', 0, 0)",
+        "code:match(subject)", NULL,
+    },
+    {
+        "match/long/nomatch",
+        BENCH_LONG "code = lpcre2.compile('id=(\\\\d+)!')",
+        "code:match(subject)", NULL,
+    },
+    {
+        "match/long/literal_absent",
+        BENCH_LONG "code = lpcre2.compile('ipsum=(\\\\d+)')",
+        "code:match(subject)", NULL,
+    },
+    {
+        "match/captures16",
+        BENCH_SHORT "code = lpcre2.compile(string.rep('(\\\\w)', 16)) t = {}",
+        "code:match_captures(subject, 0, 0, t)", NULL,
+    },
+    {
+        "match/c_api/match",
+        BENCH_SHORT "code = lpcre2.compile('(\\\\d+)-(\\\\d+)')",
+        NULL, _bench_c_match,
+    },
+    {
+        "match/c_api/match_into",
+        BENCH_SHORT "code = lpcre2.compile('(\\\\d+)-(\\\\d+)')",
+        NULL, _bench_c_match_into,
+    },
+    {
+        "gmatch/words",
+        BENCH_TEXT "code = lpcre2.compile('(\\\\w+)')",
+        "for w in code:gmatch(subject) do end", NULL,
+    },
+    {
+        "gsub/function",
+        BENCH_TEXT "code = lpcre2.compile('\\\\w+') f = function(w) return w end",
+        "code:gsub(subject, f)", NULL,
+    },
+    {
+        "split/words",
+        BENCH_TEXT "code = lpcre2.compile('\\\\s+')",
+        "code:split(subject)", NULL,
+    },
+    {
+        "count/words",
+        BENCH_TEXT "code = lpcre2.compile('\\\\w+')",
+        "code:count(subject)", NULL,
+    },
+    {
+        "substitute/global",
+        BENCH_TEXT "code = lpcre2.compile('\\\\s+')",
+        "code:substitute(subject, '_', lpcre2.PCRE2_SUBSTITUTE_GLOBAL)", NULL,
+    },
+    {
+        "substitute/c_api/global",
+        BENCH_TEXT "code = lpcre2.compile('\\\\s+')",
+        NULL, _bench_c_substitute,
+    },
+    {
+        "compile/jit",
+        BENCH_PATTERNS,
+        "lpcre2.compile(patterns[i % 128 + 1])", NULL,
+    },
+    {
+        "compile/interp",
+        BENCH_PATTERNS,
+        "lpcre2.compile(patterns[i % 128 + 1], 0, 0)", NULL,
+    },
+    {
+        "compile/cached",
+        BENCH_PATTERNS "lpcre2.cache_size(128)",
+        "lpcre2.compile(patterns[i % 128 + 1])", NULL,
+    },
+    {
+        "compile/shared",
+        BENCH_PATTERNS "keep = {} for i = 1, 128 do keep[i] = lpcre2.compile_shared(patterns[i]) end",
+        "lpcre2.compile_shared(patterns[i % 128 + 1])", NULL,
+    },
+};
+
+static int _bench_dostring(lua_State* L, const char* chunk)
+{
+    if (luaL_loadbuffer(L, chunk, strlen(chunk), "bench") != 0
+        || lua_pcall(L, 0, LUA_MULTRET, 0) != 0)
+    {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Run \p n operations. The Lua runner is at stack top if #body is set.
+ */
+static int _bench_iterate(lua_State* L, const bench_case_t* bench, size_t n)
+{
+    if (bench->run != NULL)
+    {
+        bench->run(L, n);
+        return 0;
+    }
+
+    lua_pushvalue(L, -1);
+    lua_pushnumber(L, (lua_Number)n);
+    if (lua_pcall(L, 1, 0, 0) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", bench->name, lua_tostring(L, -1));
+        return -1;
+    }
+    return 0;
+}
+
+static int _bench_run(const bench_case_t* bench, double min_ns, bench_result_t* result)
+{
+    int ret = -1;
+    bench_alloc_t alloc = { 0, 0 };
+    lua_State* L = lua_newstate(_bench_alloc, &alloc);
+    if (L == NULL)
+    {
+        return -1;
+    }
+
+    luaL_openlibs(L);
+    luaopen_lpcre2(L);
+    lua_setglobal(L, "lpcre2");
+
+    if (_bench_dostring(L, bench->setup) != 0)
+    {
+        goto finish;
+    }
+
+    if (bench->body != NULL)
+    {
+        char chunk[512];
+        snprintf(chunk, sizeof(chunk),
+            "local n = ... for i = 1, n do %s end", bench->body);
+        if (luaL_loadbuffer(L, chunk, strlen(chunk), bench->name) != 0)
+        {
+            fprintf(stderr, "%s\n", lua_tostring(L, -1));
+            goto finish;
+        }
+    }
+
+    /* Warm up: JIT stacks, match data and string interning. */
+    if (_bench_iterate(L, bench, 1) != 0)
+    {
+        goto finish;
+    }
+
+    size_t n = 1;
+    for (;;)
+    {
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        alloc.count = 0;
+        alloc.bytes = 0;
+
+        double start = _bench_now();
+        if (_bench_iterate(L, bench, n) != 0)
+        {
+            goto finish;
+        }
+        double elapsed = _bench_now() - start;
+
+        if (elapsed >= min_ns || n >= 1000000000)
+        {
+            result->iterations = n;
+            result->ns_per_op = elapsed / (double)n;
+            result->allocs_per_op = (double)alloc.count / (double)n;
+            result->bytes_per_op = (double)alloc.bytes / (double)n;
+            break;
+        }
+
+        /* Aim 20% above the target, growing at least 2x and at most 100x. */
+        double next = elapsed > 0 ? (double)n * min_ns * 1.2 / elapsed : (double)n * 100;
+        if (next < (double)n * 2)
+        {
+            next = (double)n * 2;
+        }
+        if (next > (double)n * 100)
+        {
+            next = (double)n * 100;
+        }
+        n = (size_t)next;
+    }
+    ret = 0;
+
+finish:
+    lua_close(L);
+    return ret;
+}
+
+static int _bench_selected(const char* name, int argc, char* filters[])
+{
+    int i;
+    if (argc == 0)
+    {
+        return 1;
+    }
+    for (i = 0; i < argc; i++)
+    {
+        if (strstr(name, filters[i]) != NULL)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    int json = 0;
+    double seconds = 0.5;
+    char** filters = malloc(sizeof(char*) * (size_t)argc);
+    int filter_count = 0;
+    int i, failed = 0, first = 1;
+    size_t k;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0)
+        {
+            json = 1;
+        }
+        else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+        {
+            seconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0)
+        {
+            printf("usage: %s [--json] [--time SECONDS] [FILTER...]\n", argv[0]);
+            free(filters);
+            return 0;
+        }
+        else
+        {
+            filters[filter_count++] = argv[i];
+        }
+    }
+
+    if (json)
+    {
+        printf("{\"lua\":\"%d.%d\",\"results\":[",
+            LUA_VERSION_NUM / 100, LUA_VERSION_NUM % 100);
+    }
+    else
+    {
+        printf("Lua %d.%d\n", LUA_VERSION_NUM / 100, LUA_VERSION_NUM % 100);
+        printf("%-32s %12s %14s %12s %12s\n",
+            "case", "iterations", "ns/op", "allocs/op", "B/op");
+    }
+
+    for (k = 0; k < sizeof(s_bench_cases) / sizeof(s_bench_cases[0]); k++)
+    {
+        const bench_case_t* bench = &s_bench_cases[k];
+        if (!_bench_selected(bench->name, filter_count, filters))
+        {
+            continue;
+        }
+
+        bench_result_t result;
+        if (_bench_run(bench, seconds * 1e9, &result) != 0)
+        {
+            failed = 1;
+            continue;
+        }
+
+        if (json)
+        {
+            printf("%s\n{\"name\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.2f,"
+                "\"allocs_per_op\":%.3f,\"bytes_per_op\":%.1f}",
+                first ? "" : ",", bench->name, (unsigned long)result.iterations,
+                result.ns_per_op, result.allocs_per_op, result.bytes_per_op);
+        }
+        else
+        {
+            printf("%-32s %12lu %14.1f %12.3f %12.1f\n", bench->name,
+                (unsigned long)result.iterations, result.ns_per_op,
+                result.allocs_per_op, result.bytes_per_op);
+        }
+        fflush(stdout);
+        first = 0;
+    }
+
+    if (json)
+    {
+        printf("\n]}\n");
+    }
+
+    free(filters);
+    return failed;
+}
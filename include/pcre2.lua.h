@@ -14,8 +14,11 @@ typedef struct lpcre2_match_data
     /**
      * @brief Match result.
      * The value have following meanings:
+     * + -1: No match yet, or last match failed.
      * + 0: Match success.
      * + >0: Match success, and the value is the number of captured groups.
+     * + <-1: Match hit a resource limit, and the value is the PCRE2 error
+     *   code, e.g. `PCRE2_ERROR_MATCHLIMIT`.
      */
     int rc;
 } lpcre2_match_data_t;
@@ -102,6 +105,24 @@ typedef enum lpcre2_option
     LPCRE2_SUBSTITUTE_REPLACEMENT_ONLY  = 0x00020000u,
 } lpcre2_option_t;
 
+typedef enum lpcre2_jit_option
+{
+    /**
+     * @brief JIT compile for complete matches. This is the default.
+     */
+    LPCRE2_JIT_COMPLETE                 = 0x00000001u,
+
+    /**
+     * @brief JIT compile for soft partial matches.
+     */
+    LPCRE2_JIT_PARTIAL_SOFT             = 0x00000002u,
+
+    /**
+     * @brief JIT compile for hard partial matches.
+     */
+    LPCRE2_JIT_PARTIAL_HARD             = 0x00000004u,
+} lpcre2_jit_option_t;
+
 /**
  * @brief Load pcre2 package.
  * 
@@ -137,6 +158,10 @@ typedef struct lpcre2_code lpcre2_code_t;
 
 /**
  * @brief Compile a regular expression pattern and push it on top of \p L.
+ *
+ * The pattern is also JIT compiled for complete matches, see
+ * #lpcre2_compile_ex() for details.
+ *
  * @param[in] L         Lua Stack.
  * @param[in] pattern   A string containing expression to be compiled.
  * @param[in] length    The length of the string.
@@ -152,6 +177,92 @@ typedef struct lpcre2_code lpcre2_code_t;
 lpcre2_code_t* lpcre2_compile(struct lua_State* L, const char* pattern,
     size_t length, uint32_t options);
 
+/**
+ * @brief Compile a regular expression pattern with explicit JIT modes and
+ *   push it on top of \p L.
+ *
+ * If JIT is not supported on current platform, or the JIT compile failed,
+ * the pattern still works through the interpreter.
+ *
+ * @param[in] L             Lua Stack.
+ * @param[in] pattern       A string containing expression to be compiled.
+ * @param[in] length        The length of the string.
+ * @param[in] options       Option bits. Same as #lpcre2_compile().
+ * @param[in] jit_options   Bit-OR of #lpcre2_jit_option_t, or 0 to disable JIT.
+ * @return The compiled regular expression pattern. If failed, an
+ *   error string is pushed on top of stack, and function does not return.
+ * @see https://www.pcre.org/current/doc/html/pcre2_jit_compile.html
+ */
+lpcre2_code_t* lpcre2_compile_ex(struct lua_State* L, const char* pattern,
+    size_t length, uint32_t options, uint32_t jit_options);
+
+/**
+ * @brief Compile a regular expression pattern into the process-wide shared
+ *   registry and push a code object referencing it on top of \p L.
+ *
+ * Patterns with the same \p pattern, \p options and \p jit_options share
+ * one compiled (and JIT compiled) code, no matter which Lua state or thread
+ * asks for it. The shared code is freed when the last code object referencing
+ * it is collected. This function is thread-safe.
+ *
+ * Shared codes are allocated by malloc() instead of the allocator of \p L,
+ * because they may outlive \p L.
+ *
+ * @param[in] L             Lua Stack.
+ * @param[in] pattern       A string containing expression to be compiled.
+ * @param[in] length        The length of the string.
+ * @param[in] options       Option bits. Same as #lpcre2_compile().
+ * @param[in] jit_options   Bit-OR of #lpcre2_jit_option_t, or 0 to disable JIT.
+ * @return The compiled regular expression pattern. If failed, an
+ *   error string is pushed on top of stack, and function does not return.
+ */
+lpcre2_code_t* lpcre2_compile_shared(struct lua_State* L, const char* pattern,
+    size_t length, uint32_t options, uint32_t jit_options);
+
+/**
+ * @}
+ */
+
+/**
+ * @defgroup LUA_PCRE2_SERIALIZE serialize
+ * @{
+ */
+
+/**
+ * @brief Serialize compiled patterns into a byte string and push it on top
+ *   of Lua stack \p L.
+ *
+ * The JIT options and the literal prefilter of each pattern are saved as
+ * well, but not the JIT code itself, so patterns are JIT compiled again by
+ * #lpcre2_deserialize().
+ *
+ * The byte string can only be loaded by the same version of PCRE2 on a host
+ * with the same code unit width, pointer size and endianness.
+ *
+ * @param[in] L         Lua Stack.
+ * @param[in] codes     The list of compiled patterns.
+ * @param[in] number    The number of compiled patterns.
+ * @param[out] len      The size of byte string. Can be NULL.
+ * @return Points to the byte string. If error occur, an error string is
+ *   pushed on top of stack, and function does not return.
+ * @see https://www.pcre.org/current/doc/html/pcre2serialize.html
+ */
+const char* lpcre2_serialize(struct lua_State* L, lpcre2_code_t** codes,
+    size_t number, size_t* len);
+
+/**
+ * @brief Load compiled patterns from byte string made by #lpcre2_serialize(),
+ *   and push a table of them on top of Lua stack \p L.
+ * @warning PCRE2 only does a few sanity checks on the byte string, so only
+ *   load data from a trusted source.
+ * @param[in] L         Lua Stack.
+ * @param[in] bytes     The byte string.
+ * @param[in] length    The length of byte string.
+ * @return The number of compiled patterns. If error occur, an error string is
+ *   pushed on top of stack, and function does not return.
+ */
+size_t lpcre2_deserialize(struct lua_State* L, const char* bytes, size_t length);
+
 /**
  * @}
  */
@@ -213,6 +324,43 @@ const char* lpcre2_substitute(struct lua_State* L, lpcre2_code_t* code,
 lpcre2_match_data_t* lpcre2_match(struct lua_State* L, lpcre2_code_t* code,
     const char* subject, size_t length, size_t offset, uint32_t options);
 
+/**
+ * @brief Create an empty match result for \p code and push it on top of Lua
+ *   stack \p L.
+ *
+ * The match result can be filled by #lpcre2_match_into() as many times as you
+ * want, so no allocation happens on each match. It can also be used with
+ * any other code that has no more capture groups than \p code.
+ *
+ * @param[in] L         Lua Stack.
+ * @param[in] code      The compiled regular expression pattern.
+ * @return              Empty match result.
+ */
+lpcre2_match_data_t* lpcre2_match_data_create(struct lua_State* L,
+    lpcre2_code_t* code);
+
+/**
+ * @brief Matches a compiled regular expression against a given subject string,
+ *   and store match result into \p match_data.
+ *
+ * Unlike #lpcre2_match(), nothing is pushed on Lua stack \p L, and hitting a
+ * resource limit of the match context attached to \p code is not raised but
+ * stored into lpcre2_match_data_t::rc.
+ *
+ * @param[in] L             Lua Stack.
+ * @param[in] code          The compiled regular expression pattern.
+ * @param[in] subject       The subject string.
+ * @param[in] length        Length of the subject string.
+ * @param[in] offset        Offset in the subject at which to start matching.
+ * @param[in] options       Option bits. Same as #lpcre2_match().
+ * @param[in,out] match_data Match result created by #lpcre2_match_data_create().
+ * @return                  \p match_data if match, or NULL if not match or a
+ *                          resource limit is hit.
+ */
+lpcre2_match_data_t* lpcre2_match_into(struct lua_State* L, lpcre2_code_t* code,
+    const char* subject, size_t length, size_t offset, uint32_t options,
+    lpcre2_match_data_t* match_data);
+
 /**
  * @brief Get offset of captured group.
  * @param[in] L             Lua Stack.
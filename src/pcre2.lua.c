@@ -6,6 +6,28 @@
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+typedef HANDLE lpcre2_thread_t;
+typedef SRWLOCK lpcre2_mutex_t;
+#define LPCRE2_MUTEX_INIT   SRWLOCK_INIT
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+typedef pthread_t lpcre2_thread_t;
+typedef pthread_mutex_t lpcre2_mutex_t;
+#define LPCRE2_MUTEX_INIT   PTHREAD_MUTEX_INITIALIZER
+#endif
+
 #include "lua.h"
 #include "lauxlib.h"
 #include "pcre2.lua.h"
@@ -13,6 +35,14 @@
 #define LPCRE2_CODE_NAME            "_lpcre2_code"
 #define LPCRE2_MATCH_DATA_NAME      "_lpcre2_match_data"
 #define LPCRE2_MATCH_DATA_ITER_NAME "_lpcre2_match_data_iter"
+#define LPCRE2_SET_NAME             "_lpcre2_set"
+#define LPCRE2_MATCH_CONTEXT_NAME   "_lpcre2_match_context"
+#define LPCRE2_ALLOCATOR_NAME       "_lpcre2_allocator"
+#define LPCRE2_STREAM_NAME          "_lpcre2_stream"
+#define LPCRE2_BUFFER_NAME          "_lpcre2_buffer"
+#define LPCRE2_PARALLEL_NAME        "_lpcre2_parallel"
+#define LPCRE2_STATS_NAME           "_lpcre2_stats"
+#define LPCRE2_RAISE_NAME           "_lpcre2_raise"
 
 #define LPCRE2_OPTION_MAP(xx)   \
     xx(PCRE2_ALLOW_EMPTY_CLASS)            \
@@ -24,12 +54,51 @@
     xx(PCRE2_ENDANCHORED)                  \
     xx(PCRE2_NO_UTF_CHECK)                 \
     xx(PCRE2_ANCHORED)                     \
+    xx(PCRE2_PARTIAL_SOFT)                 \
+    xx(PCRE2_PARTIAL_HARD)                 \
+    xx(PCRE2_DFA_SHORTEST)                 \
+    xx(PCRE2_DFA_RESTART)                  \
                                            \
     xx(PCRE2_SUBSTITUTE_GLOBAL)            \
     xx(PCRE2_SUBSTITUTE_EXTENDED)          \
     xx(PCRE2_SUBSTITUTE_UNSET_EMPTY)       \
     xx(PCRE2_SUBSTITUTE_UNKNOWN_UNSET)     \
-    xx(PCRE2_SUBSTITUTE_REPLACEMENT_ONLY)
+    xx(PCRE2_SUBSTITUTE_REPLACEMENT_ONLY)  \
+                                           \
+    xx(PCRE2_JIT_COMPLETE)                 \
+    xx(PCRE2_JIT_PARTIAL_SOFT)             \
+    xx(PCRE2_JIT_PARTIAL_HARD)
+
+#define LPCRE2_ERROR_MAP(xx)    \
+    xx(PCRE2_ERROR_NOMATCH)                \
+    xx(PCRE2_ERROR_PARTIAL)                \
+    xx(PCRE2_ERROR_MATCHLIMIT)             \
+    xx(PCRE2_ERROR_DEPTHLIMIT)             \
+    xx(PCRE2_ERROR_HEAPLIMIT)              \
+    xx(PCRE2_ERROR_JIT_STACKLIMIT)         \
+    xx(PCRE2_ERROR_BADOFFSET)              \
+    xx(PCRE2_ERROR_BADOPTION)              \
+    xx(PCRE2_ERROR_BADREPLACEMENT)         \
+    xx(PCRE2_ERROR_NOSUBSTRING)            \
+    xx(PCRE2_ERROR_NOMEMORY)
+
+/**
+ * @brief Match options that pcre2_jit_match() handles by itself.
+ *
+ * Any other option (for example #PCRE2_ANCHORED) requires the interpreter
+ * checks done by pcre2_match(), which then transparently calls the JIT code.
+ */
+#define LPCRE2_JIT_MATCH_OPTIONS    \
+    (PCRE2_NOTBOL | PCRE2_NOTEOL | PCRE2_NOTEMPTY | PCRE2_NOTEMPTY_ATSTART | \
+     PCRE2_NO_UTF_CHECK | PCRE2_PARTIAL_SOFT | PCRE2_PARTIAL_HARD)
+
+/* LUA_TCDATA of LuaJIT, which is not exported by its headers. */
+#define LPCRE2_TCDATA       10
+
+/**
+ * @brief Maximum length of the literal prefilter of a code.
+ */
+#define LPCRE2_LITERAL_MAX  32
 
 #define container_of(ptr, TYPE, member) \
     ((TYPE*)((char*)(ptr) - (char*)&((TYPE*)0)->member))
@@ -39,6 +108,8 @@
  */
 #if LUA_VERSION_NUM == 501
 
+#define lua_rawlen(L,i)     lua_objlen(L,i)
+
 #define luaL_newlib(L,l)  \
   (luaL_newlibtable(L,l), luaL_setfuncs(L,l,0))
 #define luaL_newlibtable(L,l)   \
@@ -84,87 +155,4397 @@ static void lua_seti(lua_State* L, int idx, lua_Integer n)
 
 #endif
 
+/**
+ * @brief Userdata types of lpcre2.
+ *
+ * Metatables are created once by luaopen_lpcre2() (or on first use through
+ * the C API), and kept in the registry under the address of
+ * `s_lpcre2_type_keys[type]`, so they are found without hashing a string.
+ * Methods also get their metatable as upvalue 1, so checking `self` does not
+ * need the registry at all.
+ */
+typedef enum lpcre2_type
+{
+    LPCRE2_TYPE_CODE,
+    LPCRE2_TYPE_MATCH_DATA,
+    LPCRE2_TYPE_MATCH_DATA_ITER,
+    LPCRE2_TYPE_SET,
+    LPCRE2_TYPE_MATCH_CONTEXT,
+    LPCRE2_TYPE_STREAM,
+    LPCRE2_TYPE_BUFFER,
+    LPCRE2_TYPE_PARALLEL,
+    LPCRE2_TYPE_MAX,
+} lpcre2_type_t;
+
+static const char* const s_lpcre2_type_names[LPCRE2_TYPE_MAX] = {
+    LPCRE2_CODE_NAME,
+    LPCRE2_MATCH_DATA_NAME,
+    LPCRE2_MATCH_DATA_ITER_NAME,
+    LPCRE2_SET_NAME,
+    LPCRE2_MATCH_CONTEXT_NAME,
+    LPCRE2_STREAM_NAME,
+    LPCRE2_BUFFER_NAME,
+    LPCRE2_PARALLEL_NAME,
+};
+
+static const char s_lpcre2_type_keys[LPCRE2_TYPE_MAX] = { 0 };
+
+static void _lpcre2_new_metatable(lua_State* L, lpcre2_type_t type);
+
+/**
+ * @brief Push metatable of \p type.
+ */
+static void _lpcre2_push_metatable(lua_State* L, lpcre2_type_t type)
+{
+    lua_pushlightuserdata(L, (void*)&s_lpcre2_type_keys[type]);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        _lpcre2_new_metatable(L, type);
+    }
+}
+
+/**
+ * @brief Set metatable of \p type to the object at stack top.
+ */
+static void _lpcre2_setmetatable(lua_State* L, lpcre2_type_t type)
+{
+    _lpcre2_push_metatable(L, type);
+    lua_setmetatable(L, -2);
+}
+
+/**
+ * @brief Same as luaL_checkudata(), without looking up \p type by name.
+ */
+static void* _lpcre2_checkudata(lua_State* L, int idx, lpcre2_type_t type)
+{
+    void* p = lua_touserdata(L, idx);
+    if (p != NULL && lua_getmetatable(L, idx))
+    {
+        _lpcre2_push_metatable(L, type);
+        int same = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+        if (same)
+        {
+            return p;
+        }
+    }
+
+    /* Raise the usual error. */
+    return luaL_checkudata(L, idx, s_lpcre2_type_names[type]);
+}
+
+/**
+ * @brief Check argument 1 of a method of \p type against upvalue 1.
+ */
+static void* _lpcre2_checkself(lua_State* L, lpcre2_type_t type)
+{
+    void* p = lua_touserdata(L, 1);
+    if (p != NULL && lua_getmetatable(L, 1))
+    {
+        int same = lua_rawequal(L, -1, lua_upvalueindex(1));
+        lua_pop(L, 1);
+        if (same)
+        {
+            return p;
+        }
+    }
+
+    return _lpcre2_checkudata(L, 1, type);
+}
+
+/**
+ * @brief A group name of a pattern.
+ */
+typedef struct lpcre2_name
+{
+    const char*     name;       /**< NUL terminated name, or NULL if the slot is empty. */
+    size_t          length;
+    uint32_t        hash;
+    uint32_t        first;      /**< Index of the first group number in #lpcre2_names::numbers. */
+    uint32_t        count;      /**< Number of groups with this name, more than 1 for `(?J)`. */
+} lpcre2_name_t;
+
+/**
+ * @brief Hash table of the group names of a pattern, decoded once from
+ *   #PCRE2_INFO_NAMETABLE.
+ *
+ * Match data keep a reference to the table of the code they were last
+ * matched by, so it is reference counted and allocated by the allocator of
+ * the Lua state, together with the slots, group numbers and names.
+ */
+typedef struct lpcre2_names
+{
+    size_t          refcount;
+    lua_Alloc       alloc;
+    void*           ud;
+    size_t          size;       /**< Size of the allocation. */
+    uint32_t        capacity;   /**< Number of slots, a power of 2. */
+    lpcre2_name_t*  slots;
+    uint32_t*       numbers;    /**< Group numbers, ascending for each name. */
+} lpcre2_names_t;
+
+/*
+ * Fields used by every match come first, so a match only touches the first
+ * cache lines of a code. The rest is only used by less common operations.
+ */
 struct lpcre2_code
 {
-    pcre2_code* code;
-    PCRE2_UCHAR message[256];
+    pcre2_code*         code;
+    pcre2_match_data*   match_data;         /**< Scratch match data, created on first use. */
+    struct lpcre2_match_context* mcontext;  /**< Attached match context, or NULL. */
+    struct lpcre2_stats* stats;             /**< Instrumentation counters, or NULL. */
+    uint32_t            options;            /**< Compile options, including in-pattern ones. */
+    uint32_t            jit_options;        /**< JIT modes that compiled successfully. */
+    uint32_t            capture_count;      /**< The highest capture group number. */
+    uint32_t            min_length;         /**< Lower bound of subject length to match. */
+    int                 first_unit;         /**< ASCII code unit that starts every match, or -1. */
+    int                 last_unit;          /**< ASCII code unit required by every match, or -1. */
+    uint32_t            literal_length;     /**< Length of #lpcre2_code::literal, 0 if none. */
+    uint32_t            literal_rare;       /**< Index of the least common unit of the literal. */
+    char                literal[LPCRE2_LITERAL_MAX]; /**< Literal required by every match. */
+
+    int                 crlf_is_newline;    /**< CRLF is a valid newline sequence. */
+    int                 mcontext_ref;       /**< Registry reference of #lpcre2_code::mcontext. */
+    lpcre2_names_t*     names;              /**< Group names, or NULL if there is none. */
+    lpcre2_code_t*      cache_prev;         /**< Previous (more recently used) cached code. */
+    lpcre2_code_t*      cache_next;         /**< Next (less recently used) cached code. */
+    int*                dfa_workspace;      /**< DFA workspace, created on first use. */
+    size_t              dfa_wscount;        /**< Number of ints in #lpcre2_code::dfa_workspace. */
+    int                 dfa_workspace_ref;  /**< Registry reference of #lpcre2_code::dfa_workspace. */
+    pcre2_match_data*   dfa_match_data;     /**< DFA match data, created on first use. */
+    struct lpcre2_shared_code* shared;      /**< Shared entry owning #lpcre2_code::code, or NULL. */
 };
 
+/**
+ * @brief LRU cache of compiled patterns used by `lpcre2.compile()`.
+ *
+ * The cached code objects are kept alive by two tables stored as upvalues of
+ * library functions: `key -> code` for lookup, and `lightuserdata(code) -> key`
+ * for eviction. The LRU order is an intrusive list in #lpcre2_code_t.
+ */
+typedef struct lpcre2_cache
+{
+    lpcre2_code_t*  head;       /**< Most recently used. */
+    lpcre2_code_t*  tail;       /**< Least recently used. */
+    size_t          size;       /**< Number of cached codes. */
+    size_t          capacity;   /**< Max number of cached codes. 0 to disable. */
+    size_t          hits;
+    size_t          misses;
+    size_t          evictions;
+} lpcre2_cache_t;
+
+#define LPCRE2_UPVALUE_CACHE        lua_upvalueindex(1)
+#define LPCRE2_UPVALUE_CACHE_KEYS   lua_upvalueindex(2)
+#define LPCRE2_UPVALUE_CACHE_CODES  lua_upvalueindex(3)
+
+/**
+ * @brief A set of patterns that are matched against the same subject.
+ */
+typedef struct lpcre2_set
+{
+    pcre2_match_data*   data;       /**< Shared match data, only for the whole match. */
+    size_t              size;       /**< Number of patterns. */
+    lpcre2_code_t       codes[1];   /**< Patterns, allocated together with the set. */
+} lpcre2_set_t;
+
+typedef struct lpcre2_match_data_iter
+{
+    pcre2_match_data*   data;
+    size_t              offset;     /**< Offset to start next match. */
+    uint32_t            options;    /**< Match options. */
+    int                 last_empty; /**< Last match is an empty string. */
+    int                 done;       /**< No more match. */
+} lpcre2_match_data_iter_t;
+
+/**
+ * @brief Routes PCRE2 memory through the allocator of the Lua state.
+ *
+ * There is one allocator per Lua state, stored in the registry. PCRE2 copies
+ * the malloc/free pair into every code, match data and context it creates,
+ * so frees keep working after the contexts here are released, as long as the
+ * allocator itself stays alive. Lua only releases memory after running all
+ * finalizers on close, so this always holds.
+ */
+typedef struct lpcre2_allocator
+{
+    lua_Alloc               allocf;
+    void*                   ud;
+    pcre2_general_context*  gcontext;   /**< Context for PCRE2 objects. */
+    pcre2_compile_context*  ccontext;   /**< Compile context using #lpcre2_allocator::gcontext. */
+    void*                   inline_block; /**< Block for the next allocation, or NULL. */
+    size_t                  inline_size;  /**< Size of #lpcre2_allocator::inline_block. */
+    size_t                  match_data_size; /**< Size of PCRE2 match data without ovector. */
+} lpcre2_allocator_t;
+
+/**
+ * @brief Header of each block, as lua_Alloc needs the block size to free it.
+ */
+typedef union lpcre2_alloc_header
+{
+    size_t      size;
+    double      align_d;
+    void*       align_p;
+    long long   align_ll;
+} lpcre2_alloc_header_t;
+
 typedef struct lpcre2_match_data_impl
 {
     lpcre2_match_data_t base;
-    pcre2_match_data*   data;
+    pcre2_match_data*   data;   /**< Points into #lpcre2_match_data_impl::block. */
+    lpcre2_names_t*     names;  /**< Group names of the code of the last match. */
+    lpcre2_alloc_header_t block[1]; /**< PCRE2 match data, allocated together. */
 } lpcre2_match_data_impl_t;
 
-static int _lpcre2_code_gc(lua_State* L)
+/**
+ * @brief Size of a block that is part of another object, and is not freed.
+ */
+#define LPCRE2_ALLOC_INLINE ((size_t)-1)
+
+/**
+ * @brief Allocate a block. If #lpcre2_allocator::inline_block is set, it is
+ *   used instead for an allocation of exactly its size, so PCRE2 objects can
+ *   be placed inside Lua userdata.
+ */
+static void* _lpcre2_malloc(PCRE2_SIZE size, void* memory_data)
 {
-    lpcre2_code_t* code = lua_touserdata(L, 1);
+    lpcre2_allocator_t* allocator = memory_data;
 
-    if (code->code != NULL)
+    if (allocator->inline_block != NULL)
     {
-        pcre2_code_free(code->code);
-        code->code = NULL;
+        lpcre2_alloc_header_t* block = allocator->inline_block;
+        allocator->inline_block = NULL;
+        if (size == allocator->inline_size)
+        {
+            block->size = LPCRE2_ALLOC_INLINE;
+            return block + 1;
+        }
+    }
+
+    if (size > (size_t)-1 - sizeof(lpcre2_alloc_header_t))
+    {
+        return NULL;
+    }
+
+    lpcre2_alloc_header_t* header = allocator->allocf(allocator->ud, NULL, 0,
+        sizeof(lpcre2_alloc_header_t) + size);
+    if (header == NULL)
+    {
+        return NULL;
+    }
+
+    header->size = size;
+    return header + 1;
+}
+
+static void _lpcre2_free(void* ptr, void* memory_data)
+{
+    lpcre2_allocator_t* allocator = memory_data;
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    lpcre2_alloc_header_t* header = (lpcre2_alloc_header_t*)ptr - 1;
+    if (header->size == LPCRE2_ALLOC_INLINE)
+    {
+        return;
+    }
+    allocator->allocf(allocator->ud, header,
+        sizeof(lpcre2_alloc_header_t) + header->size, 0);
+}
+
+static int _lpcre2_allocator_gc(lua_State* L)
+{
+    lpcre2_allocator_t* allocator = lua_touserdata(L, 1);
+
+    if (allocator->ccontext != NULL)
+    {
+        pcre2_compile_context_free(allocator->ccontext);
+        allocator->ccontext = NULL;
+    }
+
+    if (allocator->gcontext != NULL)
+    {
+        pcre2_general_context_free(allocator->gcontext);
+        allocator->gcontext = NULL;
     }
 
     return 0;
 }
 
-static int _lpcre2_match(lua_State* L)
+/**
+ * @brief Get the allocator of Lua state \p L, create it on first use.
+ */
+static lpcre2_allocator_t* _lpcre2_allocator(lua_State* L)
 {
-    lpcre2_code_t* code = luaL_checkudata(L, 1, LPCRE2_CODE_NAME);
+    lua_getfield(L, LUA_REGISTRYINDEX, LPCRE2_ALLOCATOR_NAME);
+    lpcre2_allocator_t* allocator = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    if (allocator != NULL)
+    {
+        return allocator;
+    }
 
-    size_t subject_sz = 0;
-    const char* subject = luaL_checklstring(L, 2, &subject_sz);
+    allocator = lua_newuserdata(L, sizeof(lpcre2_allocator_t));
+    allocator->allocf = lua_getallocf(L, &allocator->ud);
+    allocator->gcontext = NULL;
+    allocator->ccontext = NULL;
+    allocator->inline_block = NULL;
+    allocator->inline_size = 0;
+    allocator->match_data_size = 0;
 
-    size_t offset = lua_tointeger(L, 3);
-    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+    lua_newtable(L);
+    lua_pushcfunction(L, _lpcre2_allocator_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
 
-    if (lpcre2_match(L, code, subject, subject_sz, offset, options) == NULL)
+    allocator->gcontext = pcre2_general_context_create(_lpcre2_malloc,
+        _lpcre2_free, allocator);
+    if (allocator->gcontext == NULL
+        || (allocator->ccontext = pcre2_compile_context_create(allocator->gcontext)) == NULL)
     {
-        return 0;
+        luaL_error(L, "out of memory");
+        return NULL;
     }
-    return 1;
+
+    /* The match data layout is opaque, so measure the size of one pair. */
+    pcre2_match_data* probe = pcre2_match_data_create(1, allocator->gcontext);
+    if (probe == NULL)
+    {
+        luaL_error(L, "out of memory");
+        return NULL;
+    }
+    allocator->match_data_size = pcre2_get_match_data_size(probe) - 2 * sizeof(PCRE2_SIZE);
+    pcre2_match_data_free(probe);
+
+    lua_setfield(L, LUA_REGISTRYINDEX, LPCRE2_ALLOCATOR_NAME);
+
+    return allocator;
 }
 
-static int _lpcre2_substitute(lua_State* L)
+/**
+ * @brief Push the message of PCRE2 error \p errcode.
+ */
+static void _lpcre2_push_error(lua_State* L, int errcode)
 {
-    lpcre2_code_t* code = luaL_checkudata(L, 1, LPCRE2_CODE_NAME);
+    PCRE2_UCHAR message[256];
+    pcre2_get_error_message(errcode, message, sizeof(message) / sizeof(PCRE2_UCHAR));
+    lua_pushstring(L, (const char*)message);
+}
 
-    size_t content_sz = 0;
-    const char* content = luaL_checklstring(L, 2, &content_sz);
+/**
+ * @brief Raise the message of PCRE2 error \p errcode.
+ */
+static int _lpcre2_error(lua_State* L, int errcode)
+{
+    _lpcre2_push_error(L, errcode);
+    return lua_error(L);
+}
 
-    size_t replace_sz = 0;
-    const char* replace = luaL_checklstring(L, 3, &replace_sz);
+/**
+ * @brief Report a failure of a Lua API function whose message is on top of
+ *   \p L: raise it, or return `nil, errcode, message` if errors are not
+ *   raised, see `lpcre2.raise_errors()`.
+ */
+static int _lpcre2_fail(lua_State* L, int errcode)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, LPCRE2_RAISE_NAME);
+    int raise = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (raise)
+    {
+        return lua_error(L);
+    }
+
+    lua_pushnil(L);
+    lua_pushinteger(L, errcode);
+    lua_pushvalue(L, -3);
+    return 3;
+}
+
+/**
+ * @brief Read-only byte buffer that can be matched like a string.
+ *
+ * It is either a file mapping owned by the buffer, or memory owned by
+ * someone else.
+ */
+typedef struct lpcre2_buffer
+{
+    const char* data;       /**< NULL if closed. */
+    size_t      size;
+    int         mapped;     /**< \p data is a file mapping to unmap on close. */
+    int         owner_ref;  /**< Reference to the cdata that owns \p data. */
+} lpcre2_buffer_t;
+
+/**
+ * @brief Get the subject at \p idx, which is either a string or a buffer.
+ */
+static const char* _lpcre2_check_subject(lua_State* L, int idx, size_t* len)
+{
+    if (lua_type(L, idx) != LUA_TUSERDATA)
+    {
+        return luaL_checklstring(L, idx, len);
+    }
+
+    lpcre2_buffer_t* buffer = _lpcre2_checkudata(L, idx, LPCRE2_TYPE_BUFFER);
+    if (buffer->data == NULL)
+    {
+        luaL_error(L, "buffer is closed");
+        return NULL;
+    }
+
+    *len = buffer->size;
+    return buffer->data;
+}
+
+/**
+ * @brief Match context that limits resources used by a match.
+ */
+typedef struct lpcre2_match_context
+{
+    pcre2_match_context*    context;
+    pcre2_jit_stack*        jit_stack;      /**< Custom JIT stack, or NULL. */
+
+    /* Settings of #lpcre2_match_context::context, to build per-thread copies. */
+    uint32_t                match_limit;
+    uint32_t                depth_limit;
+    uint32_t                heap_limit;
+    size_t                  jit_stack_min;  /**< 0 if no custom JIT stack. */
+    size_t                  jit_stack_max;
+} lpcre2_match_context_t;
+
+static pcre2_match_context* _lpcre2_code_mcontext(lpcre2_code_t* code)
+{
+    return code->mcontext != NULL ? code->mcontext->context : NULL;
+}
+
+/**
+ * @brief Number of latency histogram buckets. Bucket `i` counts matches that
+ *   took less than `2^(i+1)` ns, the last one counts all slower matches.
+ */
+#define LPCRE2_STATS_HISTOGRAM_SIZE 32
+
+/**
+ * @brief Instrumentation settings of a Lua state, see `lpcre2.instrument()`.
+ *
+ * Stored in the registry table #LPCRE2_STATS_NAME, together with the slow
+ * match callback `on_slow` and the weak table `codes` of instrumented codes.
+ */
+typedef struct lpcre2_stats_config
+{
+    int         enabled;
+    int         reporting;  /**< Running the slow match callback. */
+    uint64_t    slow_ns;    /**< Threshold of slow matches, 0 if no callback. */
+} lpcre2_stats_config_t;
+
+/**
+ * @brief Counters of an instrumented code, allocated together with the code.
+ */
+typedef struct lpcre2_stats
+{
+    lpcre2_stats_config_t* config;
+    uint64_t    calls;
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    errors;
+    uint64_t    total_ns;
+    uint64_t    max_ns;
+    uint64_t    bytes;          /**< Subject bytes after the start offset. */
+    uint64_t    slow_ns;        /**< Slowest match not reported yet, or 0. */
+    size_t      slow_length;    /**< Subject length of that match. */
+    uint64_t    histogram[LPCRE2_STATS_HISTOGRAM_SIZE];
+} lpcre2_stats_t;
+
+#if defined(_WIN32)
+
+static uint64_t _lpcre2_clock_ns(void)
+{
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)((double)count.QuadPart * 1e9 / (double)freq.QuadPart);
+}
+
+#else
+
+static uint64_t _lpcre2_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+#endif
+
+/**
+ * @brief Account a match of \p length subject bytes that took \p elapsed ns.
+ */
+static void _lpcre2_stats_record(lpcre2_stats_t* stats, int rc, size_t length,
+    uint64_t elapsed)
+{
+    stats->calls++;
+    if (rc >= 0)
+    {
+        stats->hits++;
+    }
+    else if (rc == PCRE2_ERROR_NOMATCH || rc == PCRE2_ERROR_PARTIAL)
+    {
+        stats->misses++;
+    }
+    else
+    {
+        stats->errors++;
+    }
+
+    stats->total_ns += elapsed;
+    stats->bytes += length;
+    if (elapsed > stats->max_ns)
+    {
+        stats->max_ns = elapsed;
+    }
+
+    size_t bucket = 0;
+    uint64_t value = elapsed;
+    while ((value >>= 1) != 0 && bucket < LPCRE2_STATS_HISTOGRAM_SIZE - 1)
+    {
+        bucket++;
+    }
+    stats->histogram[bucket]++;
+
+    if (stats->config->slow_ns != 0 && elapsed >= stats->config->slow_ns
+        && elapsed > stats->slow_ns)
+    {
+        stats->slow_ns = elapsed;
+        stats->slow_length = length;
+    }
+}
+
+static void _lpcre2_stats_flush(lua_State* L, lpcre2_code_t* code);
+
+/**
+ * @brief Report a pending slow match of \p code to `on_slow`. Costs a single
+ *   branch if \p code is not instrumented.
+ */
+#define LPCRE2_STATS_FLUSH(L, code)                 \
+    do {                                            \
+        if ((code)->stats != NULL)                  \
+        {                                           \
+            _lpcre2_stats_flush((L), (code));       \
+        }                                           \
+    } while (0)
+
+/**
+ * @brief Check if ASCII code unit \p unit is in \p subject. Letters are
+ *   checked in both cases, as the pattern may be caseless.
+ */
+static int _lpcre2_has_unit(const char* subject, size_t length, int unit)
+{
+    if (memchr(subject, unit, length) != NULL)
+    {
+        return 1;
+    }
+
+    if (unit >= 'a' && unit <= 'z')
+    {
+        return memchr(subject, unit - 'a' + 'A', length) != NULL;
+    }
+    if (unit >= 'A' && unit <= 'Z')
+    {
+        return memchr(subject, unit - 'A' + 'a', length) != NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Find the literal of \p code in \p subject.
+ *
+ * memmem() is a GNU extension, so this scans with memchr(), which every libc
+ * vectorizes, for the least common unit of the literal, and compares the rest
+ * at each candidate.
+ */
+static const char* _lpcre2_find_literal(const lpcre2_code_t* code,
+    const char* subject, size_t length)
+{
+    size_t rare = code->literal_rare;
+    size_t tail = code->literal_length - rare;
+    const char* p = subject + rare;
+    const char* end = subject + length;
+
+    while (p < end && (size_t)(end - p) >= tail)
+    {
+        p = memchr(p, code->literal[rare], (size_t)(end - p) - tail + 1);
+        if (p == NULL)
+        {
+            return NULL;
+        }
+        if (memcmp(p - rare, code->literal, code->literal_length) == 0)
+        {
+            return p - rare;
+        }
+        p++;
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Quick check whether \p code may match \p subject from \p offset,
+ *   without calling into PCRE2.
+ *
+ * The literal of \p code starts every match, so an anchored match needs it at
+ * \p offset, and any other match cannot start before its first occurrence.
+ *
+ * @return 0 if it cannot match, 1 if it may match from \p offset, which is
+ *   updated to the first position a match may start at.
+ */
+static int _lpcre2_code_may_match(const lpcre2_code_t* code,
+    const char* subject, size_t length, size_t* offset, uint32_t options)
+{
+    size_t start = *offset;
+    if (start > length)
+    {
+        return 1; /* Let PCRE2 report bad offset. */
+    }
+
+    if (length - start < code->min_length)
+    {
+        return 0;
+    }
+
+    if (code->literal_length != 0)
+    {
+        if ((options | code->options) & PCRE2_ANCHORED)
+        {
+            if (length - start < code->literal_length
+                || memcmp(subject + start, code->literal, code->literal_length) != 0)
+            {
+                return 0;
+            }
+        }
+        else
+        {
+            const char* p = _lpcre2_find_literal(code, subject + start, length - start);
+            if (p == NULL)
+            {
+                return 0;
+            }
+            /* FIRSTLINE is relative to the start offset, so it must stay. */
+            if (!(code->options & PCRE2_FIRSTLINE))
+            {
+                start = (size_t)(p - subject);
+            }
+        }
+    }
+    else if (code->first_unit >= 0
+        && !_lpcre2_has_unit(subject + start, length - start, code->first_unit))
+    {
+        return 0;
+    }
+
+    if (code->last_unit >= 0
+        && !_lpcre2_has_unit(subject + start, length - start, code->last_unit))
+    {
+        return 0;
+    }
+
+    *offset = start;
+    return 1;
+}
+
+/**
+ * @brief Run pcre2 match, using the JIT fast path when possible.
+ *
+ * pcre2_jit_match() bypasses the sanity checks of pcre2_match(), so it is only
+ * used when the code was compiled for the requested JIT mode, the offset is in
+ * range, no interpreter-only option is given, and the subject does not need a
+ * UTF check.
+ *
+ * Subjects rejected by _lpcre2_code_may_match() fail without calling PCRE2,
+ * and the others are matched from where the literal of \p code starts. The
+ * prefilter is skipped for partial matching, where a match may end before
+ * the required units, when PCRE2 still has to report an invalid UTF
+ * subject, and for codes compiled with PCRE2_NO_START_OPTIMIZE.
+ */
+static int _lpcre2_pcre2_match_run(lpcre2_code_t* code, const char* subject,
+    size_t length, size_t offset, uint32_t options, pcre2_match_data* match_data,
+    pcre2_match_context* mcontext)
+{
+    if (!(options & (PCRE2_PARTIAL_SOFT | PCRE2_PARTIAL_HARD))
+        && (!(code->options & PCRE2_UTF) || (options & PCRE2_NO_UTF_CHECK))
+        && !(code->options & PCRE2_NO_START_OPTIMIZE)
+        && !_lpcre2_code_may_match(code, subject, length, &offset, options))
+    {
+        return PCRE2_ERROR_NOMATCH;
+    }
+
+    uint32_t jit_mode = PCRE2_JIT_COMPLETE;
+    if (options & PCRE2_PARTIAL_HARD)
+    {
+        jit_mode = PCRE2_JIT_PARTIAL_HARD;
+    }
+    else if (options & PCRE2_PARTIAL_SOFT)
+    {
+        jit_mode = PCRE2_JIT_PARTIAL_SOFT;
+    }
+
+    if ((code->jit_options & jit_mode)
+        && offset <= length
+        && (options & ~LPCRE2_JIT_MATCH_OPTIONS) == 0
+        && (!(code->options & PCRE2_UTF) || (options & PCRE2_NO_UTF_CHECK)))
+    {
+        return pcre2_jit_match(code->code, (PCRE2_SPTR)subject, length,
+            offset, options, match_data, mcontext);
+    }
+
+    return pcre2_match(code->code, (PCRE2_SPTR)subject, length, offset,
+        options, match_data, mcontext);
+}
+
+/**
+ * @brief Same as _lpcre2_pcre2_match_run(), and account the match if \p code
+ *   is instrumented.
+ */
+static int _lpcre2_pcre2_match(lpcre2_code_t* code, const char* subject,
+    size_t length, size_t offset, uint32_t options, pcre2_match_data* match_data,
+    pcre2_match_context* mcontext)
+{
+    if (code->stats == NULL || !code->stats->config->enabled)
+    {
+        return _lpcre2_pcre2_match_run(code, subject, length, offset, options,
+            match_data, mcontext);
+    }
+
+    uint64_t start = _lpcre2_clock_ns();
+    int rc = _lpcre2_pcre2_match_run(code, subject, length, offset, options,
+        match_data, mcontext);
+    _lpcre2_stats_record(code->stats, rc, offset < length ? length - offset : 0,
+        _lpcre2_clock_ns() - start);
+
+    return rc;
+}
+
+/**
+ * @brief Get offset of next character after \p offset.
+ *
+ * A CRLF sequence is treated as one character if it is a valid newline, and
+ * in UTF mode the whole multi-byte character is skipped.
+ */
+static size_t _lpcre2_next_char(lpcre2_code_t* code, const char* subject,
+    size_t length, size_t offset)
+{
+    offset++;
+
+    if (code->crlf_is_newline && offset < length
+        && subject[offset - 1] == '\r' && subject[offset] == '\n')
+    {
+        return offset + 1;
+    }
+
+    if (code->options & PCRE2_UTF)
+    {
+        while (offset < length && (subject[offset] & 0xc0) == 0x80)
+        {
+            offset++;
+        }
+    }
+
+    return offset;
+}
+
+/**
+ * @brief Find next match in \p subject, and advance \p iter.
+ *
+ * This follows the way pcre2demo handles empty matches: after an empty match,
+ * try a non-empty match at the same position first, and only move forward by
+ * one character if that fails.
+ *
+ * @return Same as pcre2_match(). #PCRE2_ERROR_NOMATCH if no more match.
+ */
+static int _lpcre2_iter_next(lpcre2_code_t* code, const char* subject,
+    size_t length, lpcre2_match_data_iter_t* iter, pcre2_match_context* mcontext)
+{
+    int rc;
+
+    while (!iter->done && iter->offset <= length)
+    {
+        uint32_t options = iter->options;
+        if (iter->last_empty)
+        {
+            options |= PCRE2_NOTEMPTY_ATSTART | PCRE2_ANCHORED;
+        }
+
+        rc = _lpcre2_pcre2_match(code, subject, length, iter->offset,
+            options, iter->data, mcontext);
+        if (rc == PCRE2_ERROR_NOMATCH && iter->last_empty)
+        {
+            iter->last_empty = 0;
+            iter->offset = _lpcre2_next_char(code, subject, length, iter->offset);
+            continue;
+        }
+        if (rc < 0)
+        {
+            iter->done = 1;
+            return rc;
+        }
+
+        PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(iter->data);
+        if (ovector[0] > ovector[1])
+        {
+            /* \K in a lookaround can set the start after the end. */
+            iter->done = 1;
+            return PCRE2_ERROR_BADOFFSET;
+        }
+
+        iter->last_empty = ovector[0] == ovector[1];
+        iter->offset = ovector[1];
+        return rc;
+    }
+
+    iter->done = 1;
+    return PCRE2_ERROR_NOMATCH;
+}
+
+/**
+ * @brief Push captured group \p idx. An unset group is pushed as false, so it
+ *   does not stop a generic for.
+ * @param[in] rc    Return value of a successful match.
+ */
+static void _lpcre2_push_group(lua_State* L, const char* subject,
+    pcre2_match_data* match_data, int rc, int idx)
+{
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(match_data);
+
+    if (idx >= rc || ovector[2 * idx] == PCRE2_UNSET)
+    {
+        lua_pushboolean(L, 0);
+        return;
+    }
+
+    lua_pushlstring(L, subject + ovector[2 * idx],
+        ovector[2 * idx + 1] - ovector[2 * idx]);
+}
+
+/**
+ * @brief Push all captured groups, or the whole match if pattern has no
+ *   capture groups.
+ * @param[in] rc    Return value of a successful match.
+ * @return          The number of values pushed.
+ */
+static int _lpcre2_push_captures(lua_State* L, lpcre2_code_t* code,
+    const char* subject, pcre2_match_data* match_data, int rc)
+{
+    int idx;
+
+    if (code->capture_count == 0)
+    {
+        _lpcre2_push_group(L, subject, match_data, rc, 0);
+        return 1;
+    }
+
+    luaL_checkstack(L, (int)code->capture_count, "too many captures");
+    for (idx = 1; idx <= (int)code->capture_count; idx++)
+    {
+        _lpcre2_push_group(L, subject, match_data, rc, idx);
+    }
+
+    return (int)code->capture_count;
+}
+
+/**
+ * @brief FNV-1a hash of \p length bytes.
+ */
+static uint32_t _lpcre2_hash(const char* data, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief A compiled pattern shared by code objects of every Lua state in the
+ *   process.
+ *
+ * Compiled code (including JIT code) is read-only while matching, so it is
+ * safe to use from multiple threads. Entries are allocated by malloc(), not
+ * by the allocator of a Lua state, because they may outlive the state that
+ * created them.
+ */
+typedef struct lpcre2_shared_code
+{
+    struct lpcre2_shared_code* next;    /**< Next entry in the same bucket. */
+    pcre2_code*     code;
+    size_t          hash;
+    size_t          refcount;           /**< Number of code objects using this entry. */
+    uint32_t        options;            /**< Compile options as requested. */
+    uint32_t        jit_request;        /**< JIT options as requested. */
+    uint32_t        jit_options;        /**< JIT modes that compiled successfully. */
+    size_t          length;             /**< Length of #lpcre2_shared_code::pattern. */
+    char            pattern[1];         /**< Pattern, allocated together with the entry. */
+} lpcre2_shared_code_t;
+
+/**
+ * @brief Process-wide hash table of shared codes, guarded by #lock.
+ */
+typedef struct lpcre2_shared_registry
+{
+    lpcre2_mutex_t          lock;
+    lpcre2_shared_code_t**  buckets;
+    size_t                  capacity;   /**< Number of buckets, a power of 2. */
+    size_t                  size;       /**< Number of entries. */
+    size_t                  references; /**< Sum of refcount of all entries. */
+} lpcre2_shared_registry_t;
+
+static lpcre2_shared_registry_t s_lpcre2_shared = { LPCRE2_MUTEX_INIT, NULL, 0, 0, 0 };
+
+#if defined(_WIN32)
+
+static void _lpcre2_shared_lock(void)
+{
+    AcquireSRWLockExclusive(&s_lpcre2_shared.lock);
+}
+
+static void _lpcre2_shared_unlock(void)
+{
+    ReleaseSRWLockExclusive(&s_lpcre2_shared.lock);
+}
+
+#else
+
+static void _lpcre2_shared_lock(void)
+{
+    pthread_mutex_lock(&s_lpcre2_shared.lock);
+}
+
+static void _lpcre2_shared_unlock(void)
+{
+    pthread_mutex_unlock(&s_lpcre2_shared.lock);
+}
+
+#endif
+
+/**
+ * @brief FNV-1a hash of the registry key.
+ */
+static size_t _lpcre2_shared_hash(const char* pattern, size_t length,
+    uint32_t options, uint32_t jit_options)
+{
+    uint32_t hash = _lpcre2_hash(pattern, length);
+    hash = (hash ^ options) * 16777619u;
+    hash = (hash ^ jit_options) * 16777619u;
+
+    return hash;
+}
+
+/**
+ * @brief Find an entry. The registry must be locked.
+ */
+static lpcre2_shared_code_t* _lpcre2_shared_find(size_t hash,
+    const char* pattern, size_t length, uint32_t options, uint32_t jit_options)
+{
+    if (s_lpcre2_shared.capacity == 0)
+    {
+        return NULL;
+    }
+
+    lpcre2_shared_code_t* entry =
+        s_lpcre2_shared.buckets[hash & (s_lpcre2_shared.capacity - 1)];
+    for (; entry != NULL; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->length == length
+            && entry->options == options && entry->jit_request == jit_options
+            && memcmp(entry->pattern, pattern, length) == 0)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Insert an entry. The registry must be locked.
+ * @return 0 if out of memory.
+ */
+static int _lpcre2_shared_insert(lpcre2_shared_code_t* entry)
+{
+    if (s_lpcre2_shared.size >= s_lpcre2_shared.capacity)
+    {
+        size_t capacity = s_lpcre2_shared.capacity != 0
+            ? s_lpcre2_shared.capacity * 2 : 64;
+        lpcre2_shared_code_t** buckets = calloc(capacity, sizeof(*buckets));
+        if (buckets == NULL && s_lpcre2_shared.capacity == 0)
+        {
+            return 0;
+        }
+
+        /* If growing failed, longer chains are still correct. */
+        if (buckets != NULL)
+        {
+            size_t i;
+            for (i = 0; i < s_lpcre2_shared.capacity; i++)
+            {
+                lpcre2_shared_code_t* node = s_lpcre2_shared.buckets[i];
+                while (node != NULL)
+                {
+                    lpcre2_shared_code_t* next = node->next;
+                    node->next = buckets[node->hash & (capacity - 1)];
+                    buckets[node->hash & (capacity - 1)] = node;
+                    node = next;
+                }
+            }
+            free(s_lpcre2_shared.buckets);
+            s_lpcre2_shared.buckets = buckets;
+            s_lpcre2_shared.capacity = capacity;
+        }
+    }
+
+    lpcre2_shared_code_t** bucket =
+        &s_lpcre2_shared.buckets[entry->hash & (s_lpcre2_shared.capacity - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    s_lpcre2_shared.size++;
+
+    return 1;
+}
+
+/**
+ * @brief Get a referenced entry for the key, compiling the pattern if it is
+ *   not registered yet.
+ *
+ * The pattern is compiled without holding the lock. If another thread
+ * registers the same key meanwhile, its entry wins and ours is dropped.
+ *
+ * @return The entry, or NULL with \p errcode and \p erroffset set.
+ */
+static lpcre2_shared_code_t* _lpcre2_shared_acquire(const char* pattern,
+    size_t length, uint32_t options, uint32_t jit_options,
+    int* errcode, PCRE2_SIZE* erroffset)
+{
+    size_t hash = _lpcre2_shared_hash(pattern, length, options, jit_options);
+
+    _lpcre2_shared_lock();
+    lpcre2_shared_code_t* entry =
+        _lpcre2_shared_find(hash, pattern, length, options, jit_options);
+    if (entry != NULL)
+    {
+        entry->refcount++;
+        s_lpcre2_shared.references++;
+        _lpcre2_shared_unlock();
+        return entry;
+    }
+    _lpcre2_shared_unlock();
+
+    pcre2_code* code = pcre2_compile((PCRE2_SPTR)pattern, length, options,
+        errcode, erroffset, NULL);
+    if (code == NULL)
+    {
+        return NULL;
+    }
+
+    lpcre2_shared_code_t* created = malloc(sizeof(lpcre2_shared_code_t) + length);
+    if (created == NULL)
+    {
+        pcre2_code_free(code);
+        *errcode = PCRE2_ERROR_NOMEMORY;
+        *erroffset = 0;
+        return NULL;
+    }
+    created->next = NULL;
+    created->code = code;
+    created->hash = hash;
+    created->refcount = 1;
+    created->options = options;
+    created->jit_request = jit_options;
+    created->jit_options = 0;
+    created->length = length;
+    memcpy(created->pattern, pattern, length);
+    created->pattern[length] = '\0';
+
+    if (jit_options != 0 && pcre2_jit_compile(code, jit_options) == 0)
+    {
+        created->jit_options = jit_options;
+    }
+
+    _lpcre2_shared_lock();
+    entry = _lpcre2_shared_find(hash, pattern, length, options, jit_options);
+    if (entry != NULL)
+    {
+        entry->refcount++;
+    }
+    else if (_lpcre2_shared_insert(created))
+    {
+        entry = created;
+        created = NULL;
+    }
+    if (entry != NULL)
+    {
+        s_lpcre2_shared.references++;
+    }
+    _lpcre2_shared_unlock();
+
+    if (created != NULL)
+    {
+        pcre2_code_free(created->code);
+        free(created);
+    }
+    if (entry == NULL)
+    {
+        *errcode = PCRE2_ERROR_NOMEMORY;
+        *erroffset = 0;
+    }
+
+    return entry;
+}
+
+/**
+ * @brief Drop a reference, and free \p entry if it was the last one.
+ */
+static void _lpcre2_shared_release(lpcre2_shared_code_t* entry)
+{
+    _lpcre2_shared_lock();
+    s_lpcre2_shared.references--;
+    if (--entry->refcount != 0)
+    {
+        _lpcre2_shared_unlock();
+        return;
+    }
+
+    lpcre2_shared_code_t** node =
+        &s_lpcre2_shared.buckets[entry->hash & (s_lpcre2_shared.capacity - 1)];
+    while (*node != entry)
+    {
+        node = &(*node)->next;
+    }
+    *node = entry->next;
+
+    if (--s_lpcre2_shared.size == 0)
+    {
+        free(s_lpcre2_shared.buckets);
+        s_lpcre2_shared.buckets = NULL;
+        s_lpcre2_shared.capacity = 0;
+    }
+    _lpcre2_shared_unlock();
+
+    pcre2_code_free(entry->code);
+    free(entry);
+}
+
+/**
+ * @brief Decode the group names of \p code into a hash table.
+ * @return The table, or NULL if the pattern has no named group.
+ */
+static lpcre2_names_t* _lpcre2_names_new(lua_State* L, const pcre2_code* code)
+{
+    uint32_t count = 0, entry_size = 0;
+    PCRE2_SPTR table = NULL;
+    pcre2_pattern_info(code, PCRE2_INFO_NAMECOUNT, &count);
+    if (count == 0)
+    {
+        return NULL;
+    }
+    pcre2_pattern_info(code, PCRE2_INFO_NAMEENTRYSIZE, &entry_size);
+    pcre2_pattern_info(code, PCRE2_INFO_NAMETABLE, &table);
+
+    /* At most half of the slots are used, so probing always ends. */
+    uint32_t capacity = 4;
+    while (capacity < count * 2)
+    {
+        capacity *= 2;
+    }
+
+    void* ud = NULL;
+    lua_Alloc alloc = lua_getallocf(L, &ud);
+    size_t size = sizeof(lpcre2_names_t) + sizeof(lpcre2_name_t) * capacity
+        + sizeof(uint32_t) * count + (size_t)(entry_size - 2) * count;
+    lpcre2_names_t* names = alloc(ud, NULL, 0, size);
+    if (names == NULL)
+    {
+        luaL_error(L, "out of memory");
+        return NULL;
+    }
+    names->refcount = 1;
+    names->alloc = alloc;
+    names->ud = ud;
+    names->size = size;
+    names->capacity = capacity;
+    names->slots = (lpcre2_name_t*)(names + 1);
+    names->numbers = (uint32_t*)(names->slots + capacity);
+    memset(names->slots, 0, sizeof(lpcre2_name_t) * capacity);
+
+    /*
+     * Each entry is a big-endian group number followed by the name. Entries
+     * are sorted by name, and those of a duplicate name by number.
+     */
+    char* strings = (char*)(names->numbers + count);
+    lpcre2_name_t* slot = NULL;
+    uint32_t i;
+    for (i = 0; i < count; i++)
+    {
+        PCRE2_SPTR entry = table + i * entry_size;
+        const char* name = (const char*)entry + 2;
+        size_t length = strlen(name);
+        names->numbers[i] = (uint32_t)((entry[0] << 8) | entry[1]);
+
+        if (slot != NULL && slot->length == length
+            && memcmp(slot->name, name, length) == 0)
+        {
+            slot->count++;
+            continue;
+        }
+
+        uint32_t hash = _lpcre2_hash(name, length);
+        slot = &names->slots[hash & (capacity - 1)];
+        while (slot->name != NULL)
+        {
+            slot = &names->slots[(slot - names->slots + 1) & (capacity - 1)];
+        }
+
+        memcpy(strings, name, length + 1);
+        slot->name = strings;
+        slot->length = length;
+        slot->hash = hash;
+        slot->first = i;
+        slot->count = 1;
+        strings += length + 1;
+    }
+
+    return names;
+}
+
+static void _lpcre2_names_release(lpcre2_names_t* names)
+{
+    if (names != NULL && --names->refcount == 0)
+    {
+        names->alloc(names->ud, names, names->size, 0);
+    }
+}
+
+/**
+ * @brief Find group \p name in \p names, which may be NULL.
+ * @return The name, or NULL if there is no such group.
+ */
+static const lpcre2_name_t* _lpcre2_names_find(const lpcre2_names_t* names,
+    const char* name, size_t length)
+{
+    if (names == NULL)
+    {
+        return NULL;
+    }
+
+    uint32_t hash = _lpcre2_hash(name, length);
+    uint32_t i = hash & (names->capacity - 1);
+    for (; names->slots[i].name != NULL; i = (i + 1) & (names->capacity - 1))
+    {
+        const lpcre2_name_t* slot = &names->slots[i];
+        if (slot->hash == hash && slot->length == length
+            && memcmp(slot->name, name, length) == 0)
+        {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Find the first group of \p slot that is set in \p match_data.
+ * @return The group number, or -1 if none is set.
+ */
+static int _lpcre2_names_first_set(const lpcre2_names_t* names,
+    const lpcre2_name_t* slot, const lpcre2_match_data_impl_t* match_data)
+{
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(match_data->data);
+    uint32_t i;
+
+    for (i = 0; i < slot->count; i++)
+    {
+        uint32_t number = names->numbers[slot->first + i];
+        if ((int)number <= match_data->base.rc && ovector[2 * number] != PCRE2_UNSET)
+        {
+            return (int)number;
+        }
+    }
+
+    return -1;
+}
+
+static void _lpcre2_code_init(lpcre2_code_t* code)
+{
+    code->code = NULL;
+    code->options = 0;
+    code->jit_options = 0;
+    code->capture_count = 0;
+    code->crlf_is_newline = 0;
+    code->min_length = 0;
+    code->first_unit = -1;
+    code->last_unit = -1;
+    code->literal_length = 0;
+    code->literal_rare = 0;
+    code->cache_prev = NULL;
+    code->cache_next = NULL;
+    code->match_data = NULL;
+    code->mcontext = NULL;
+    code->mcontext_ref = LUA_NOREF;
+    code->dfa_workspace = NULL;
+    code->dfa_wscount = 0;
+    code->dfa_workspace_ref = LUA_NOREF;
+    code->dfa_match_data = NULL;
+    code->shared = NULL;
+    code->names = NULL;
+    code->stats = NULL;
+}
+
+static void _lpcre2_code_release(lpcre2_code_t* code)
+{
+    if (code->match_data != NULL)
+    {
+        pcre2_match_data_free(code->match_data);
+        code->match_data = NULL;
+    }
+
+    if (code->dfa_match_data != NULL)
+    {
+        pcre2_match_data_free(code->dfa_match_data);
+        code->dfa_match_data = NULL;
+    }
+
+    _lpcre2_names_release(code->names);
+    code->names = NULL;
+
+    if (code->shared != NULL)
+    {
+        _lpcre2_shared_release(code->shared);
+        code->shared = NULL;
+        code->code = NULL;
+    }
+    else if (code->code != NULL)
+    {
+        pcre2_code_free(code->code);
+        code->code = NULL;
+    }
+}
+
+static int _lpcre2_code_gc(lua_State* L)
+{
+    lpcre2_code_t* code = lua_touserdata(L, 1);
+
+    _lpcre2_code_release(code);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, code->mcontext_ref);
+    code->mcontext_ref = LUA_NOREF;
+    code->mcontext = NULL;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, code->dfa_workspace_ref);
+    code->dfa_workspace_ref = LUA_NOREF;
+    code->dfa_workspace = NULL;
+
+    return 0;
+}
+
+/**
+ * @brief Get the scratch match data of \p code, creating it on first use.
+ *
+ * Same as the one used by _lpcre2_code_scratch_match(), so it must not be
+ * used across anything that may call back into Lua either.
+ */
+static pcre2_match_data* _lpcre2_code_scratch(lua_State* L, lpcre2_code_t* code)
+{
+    if (code->match_data == NULL
+        && (code->match_data = pcre2_match_data_create_from_pattern(code->code, NULL)) == NULL)
+    {
+        luaL_error(L, "out of memory");
+        return NULL;
+    }
+
+    return code->match_data;
+}
+
+/**
+ * @brief Run a match with the scratch match data of \p code.
+ *
+ * The scratch match data is only valid until next call, so it must not be
+ * used across anything that may call back into Lua.
+ *
+ * @return The scratch match data if match, or NULL if not match or on error,
+ *   in which case \p rc is the PCRE2 error code.
+ */
+static pcre2_match_data* _lpcre2_code_scratch_match(lua_State* L,
+    lpcre2_code_t* code, const char* subject, size_t length, size_t offset,
+    uint32_t options, int* rc)
+{
+    _lpcre2_code_scratch(L, code);
+
+    *rc = _lpcre2_pcre2_match(code, subject, length, offset, options,
+        code->match_data, _lpcre2_code_mcontext(code));
+    LPCRE2_STATS_FLUSH(L, code);
+    if (*rc < 0)
+    {
+        return NULL;
+    }
+
+    return code->match_data;
+}
+
+#define LPCRE2_IS_LIMIT_ERROR(rc)   \
+    ((rc) == PCRE2_ERROR_MATCHLIMIT || (rc) == PCRE2_ERROR_DEPTHLIMIT || \
+     (rc) == PCRE2_ERROR_HEAPLIMIT || (rc) == PCRE2_ERROR_JIT_STACKLIMIT)
+
+/**
+ * @brief Report match error \p rc of a Lua API function. A resource limit
+ *   returns `false, errcode, message` like `code:match()`, any other error
+ *   is reported by _lpcre2_fail().
+ */
+static int _lpcre2_match_error(lua_State* L, int rc)
+{
+    _lpcre2_push_error(L, rc);
+    if (!LPCRE2_IS_LIMIT_ERROR(rc))
+    {
+        return _lpcre2_fail(L, rc);
+    }
+
+    lua_pushboolean(L, 0);
+    lua_pushinteger(L, rc);
+    lua_pushvalue(L, -3);
+    return 3;
+}
+
+/**
+ * @brief Match into \p match_data with match context \p mcontext.
+ *
+ * Errors are not raised. Hitting a resource limit sets \p match_data->rc to
+ * the PCRE2 error code. Any other error sets \p error to the PCRE2 error code,
+ * which is 0 otherwise.
+ */
+static lpcre2_match_data_t* _lpcre2_match_into(lua_State* L,
+    lpcre2_code_t* code, const char* subject, size_t length, size_t offset,
+    uint32_t options, lpcre2_match_data_t* match_data,
+    pcre2_match_context* mcontext, int* error)
+{
+    *error = 0;
+
+    lpcre2_match_data_impl_t* data = container_of(match_data, lpcre2_match_data_impl_t, base);
+
+    if (pcre2_get_ovector_count(data->data) <= code->capture_count)
+    {
+        luaL_error(L, "match data too small for pattern");
+        return NULL;
+    }
+
+    if (data->names != code->names)
+    {
+        _lpcre2_names_release(data->names);
+        if ((data->names = code->names) != NULL)
+        {
+            data->names->refcount++;
+        }
+    }
+
+    data->base.rc = _lpcre2_pcre2_match(code, subject, length, offset,
+        options, data->data, mcontext);
+    LPCRE2_STATS_FLUSH(L, code);
+    if (data->base.rc < 0)
+    {
+        if (data->base.rc == PCRE2_ERROR_NOMATCH
+            || LPCRE2_IS_LIMIT_ERROR(data->base.rc))
+        {
+            return NULL;
+        }
+
+        *error = data->base.rc;
+        data->base.rc = PCRE2_ERROR_NOMATCH;
+        return NULL;
+    }
+
+    data->base.rc--;
+
+    return &data->base;
+}
+
+static int _lpcre2_match(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    size_t subject_sz = 0;
+    const char* subject = _lpcre2_check_subject(L, 2, &subject_sz);
+
+    size_t offset = lua_tointeger(L, 3);
+    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+
+    pcre2_match_context* mcontext = _lpcre2_code_mcontext(code);
+    if (!lua_isnoneornil(L, 6))
+    {
+        lpcre2_match_context_t* context = _lpcre2_checkudata(L, 6, LPCRE2_TYPE_MATCH_CONTEXT);
+        mcontext = context->context;
+    }
+
+    lpcre2_match_data_t* match_data;
+    if (lua_isnoneornil(L, 5))
+    {
+        match_data = lpcre2_match_data_create(L, code);
+    }
+    else
+    {
+        lpcre2_match_data_impl_t* impl = _lpcre2_checkudata(L, 5, LPCRE2_TYPE_MATCH_DATA);
+        match_data = &impl->base;
+        lua_pushvalue(L, 5);
+    }
+
+    int error;
+    if (_lpcre2_match_into(L, code, subject, subject_sz, offset, options,
+        match_data, mcontext, &error) != NULL)
+    {
+        return 1;
+    }
+    if (error != 0)
+    {
+        return _lpcre2_match_error(L, error);
+    }
+
+    if (match_data->rc == PCRE2_ERROR_NOMATCH)
+    {
+        return 0;
+    }
+
+    return _lpcre2_match_error(L, match_data->rc);
+}
+
+static int _lpcre2_match_captures(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    size_t subject_sz = 0;
+    const char* subject = _lpcre2_check_subject(L, 2, &subject_sz);
+
+    size_t offset = lua_tointeger(L, 3);
+    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+
+    int rc;
+    pcre2_match_data* match_data = _lpcre2_code_scratch_match(L, code,
+        subject, subject_sz, offset, options, &rc);
+    if (match_data == NULL)
+    {
+        if (rc != PCRE2_ERROR_NOMATCH)
+        {
+            return _lpcre2_match_error(L, rc);
+        }
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (lua_isnoneornil(L, 5))
+    {
+        return _lpcre2_push_captures(L, code, subject, match_data, rc);
+    }
+
+    int idx;
+    luaL_checktype(L, 5, LUA_TTABLE);
+    lua_settop(L, 5);
+    for (idx = 0; idx <= (int)code->capture_count; idx++)
+    {
+        _lpcre2_push_group(L, subject, match_data, rc, idx);
+        lua_rawseti(L, 5, idx);
+    }
+
+    return 1;
+}
+
+static int _lpcre2_match_offsets(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    size_t subject_sz = 0;
+    const char* subject = _lpcre2_check_subject(L, 2, &subject_sz);
+
+    size_t offset = lua_tointeger(L, 3);
+    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+
+    int rc;
+    pcre2_match_data* match_data = _lpcre2_code_scratch_match(L, code,
+        subject, subject_sz, offset, options, &rc);
+    if (match_data == NULL)
+    {
+        if (rc != PCRE2_ERROR_NOMATCH)
+        {
+            return _lpcre2_match_error(L, rc);
+        }
+        lua_pushnil(L);
+        return 1;
+    }
+
+    int idx;
+    int last = (int)code->capture_count;
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(match_data);
+    luaL_checkstack(L, 2 * (last + 1), "too many captures");
+
+    /* Same as group_offset(): 1-based and inclusive, so string.sub() works. */
+    for (idx = 0; idx <= last; idx++)
+    {
+        if (idx >= rc || ovector[2 * idx] == PCRE2_UNSET)
+        {
+            lua_pushboolean(L, 0);
+            lua_pushboolean(L, 0);
+            continue;
+        }
+        lua_pushinteger(L, (lua_Integer)ovector[2 * idx] + 1);
+        lua_pushinteger(L, (lua_Integer)ovector[2 * idx + 1]);
+    }
+
+    return 2 * (last + 1);
+}
+
+static void _lpcre2_buffer_close(lua_State* L, lpcre2_buffer_t* buffer)
+{
+    if (buffer->mapped && buffer->size != 0)
+    {
+#if defined(_WIN32)
+        UnmapViewOfFile(buffer->data);
+#else
+        munmap((void*)buffer->data, buffer->size);
+#endif
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, buffer->owner_ref);
+
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->mapped = 0;
+    buffer->owner_ref = LUA_NOREF;
+}
+
+static int _lpcre2_buffer_gc(lua_State* L)
+{
+    lpcre2_buffer_t* buffer = lua_touserdata(L, 1);
+
+    _lpcre2_buffer_close(L, buffer);
+
+    return 0;
+}
+
+static int _lpcre2_buffer_close_method(lua_State* L)
+{
+    lpcre2_buffer_t* buffer = _lpcre2_checkself(L, LPCRE2_TYPE_BUFFER);
+
+    _lpcre2_buffer_close(L, buffer);
+
+    return 0;
+}
+
+static int _lpcre2_buffer_len(lua_State* L)
+{
+    lpcre2_buffer_t* buffer = _lpcre2_checkself(L, LPCRE2_TYPE_BUFFER);
+
+    lua_pushinteger(L, (lua_Integer)buffer->size);
+
+    return 1;
+}
+
+static lpcre2_buffer_t* _lpcre2_buffer_new(lua_State* L)
+{
+    lpcre2_buffer_t* buffer = lua_newuserdata(L, sizeof(lpcre2_buffer_t));
+    buffer->data = NULL;
+    buffer->size = 0;
+    buffer->mapped = 0;
+    buffer->owner_ref = LUA_NOREF;
+
+    _lpcre2_setmetatable(L, LPCRE2_TYPE_BUFFER);
+
+    return buffer;
+}
+
+static int _lpcre2_mapfile(lua_State* L)
+{
+    const char* path = luaL_checkstring(L, 1);
+
+    lpcre2_buffer_t* buffer = _lpcre2_buffer_new(L);
+
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return luaL_error(L, "cannot open `%s`: error %d", path, (int)GetLastError());
+    }
+
+    LARGE_INTEGER file_sz;
+    if (!GetFileSizeEx(file, &file_sz) || (unsigned long long)file_sz.QuadPart > (size_t)-1)
+    {
+        CloseHandle(file);
+        return luaL_error(L, "cannot map `%s`: file too large", path);
+    }
+
+    size_t size = (size_t)file_sz.QuadPart;
+    const char* data = "";
+    if (size != 0)
+    {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        data = mapping != NULL ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        DWORD errcode = GetLastError();
+        if (mapping != NULL)
+        {
+            CloseHandle(mapping);
+        }
+        if (data == NULL)
+        {
+            CloseHandle(file);
+            return luaL_error(L, "cannot map `%s`: error %d", path, (int)errcode);
+        }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return luaL_error(L, "cannot open `%s`: %s", path, strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        int errcode = errno;
+        close(fd);
+        return luaL_error(L, "cannot map `%s`: %s", path, strerror(errcode));
+    }
+    if ((unsigned long long)st.st_size > (size_t)-1)
+    {
+        close(fd);
+        return luaL_error(L, "cannot map `%s`: file too large", path);
+    }
+
+    /* mmap() refuses an empty mapping. */
+    size_t size = (size_t)st.st_size;
+    const char* data = "";
+    if (size != 0)
+    {
+        void* addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            int errcode = errno;
+            close(fd);
+            return luaL_error(L, "cannot map `%s`: %s", path, strerror(errcode));
+        }
+        data = addr;
+    }
+    close(fd);
+#endif
+
+    buffer->data = data;
+    buffer->size = size;
+    buffer->mapped = 1;
+
+    return 1;
+}
+
+static int _lpcre2_buffer(lua_State* L)
+{
+    /* A LuaJIT cdata is wrapped at its own storage, like an FFI array. */
+    int type = lua_type(L, 1);
+    luaL_argcheck(L, type == LUA_TLIGHTUSERDATA || type == LPCRE2_TCDATA,
+        1, "light userdata or cdata expected");
+    const char* data = type == LUA_TLIGHTUSERDATA ?
+        lua_touserdata(L, 1) : lua_topointer(L, 1);
+    lua_Integer size = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, size >= 0 && (data != NULL || size == 0), 2,
+        "invalid size");
+
+    lpcre2_buffer_t* buffer = _lpcre2_buffer_new(L);
+    buffer->data = data != NULL ? data : "";
+    buffer->size = (size_t)size;
+
+    /* Keep the cdata alive while the buffer uses its storage. */
+    if (type == LPCRE2_TCDATA)
+    {
+        lua_pushvalue(L, 1);
+        buffer->owner_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    return 1;
+}
+
+static int _lpcre2_match_context_gc(lua_State* L)
+{
+    lpcre2_match_context_t* context = lua_touserdata(L, 1);
+
+    if (context->context != NULL)
+    {
+        pcre2_match_context_free(context->context);
+        context->context = NULL;
+    }
+
+    if (context->jit_stack != NULL)
+    {
+        pcre2_jit_stack_free(context->jit_stack);
+        context->jit_stack = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Get optional non-negative integer field \p name from table at \p idx.
+ * @return 1 if field exists, 0 if not.
+ */
+static int _lpcre2_opt_field(lua_State* L, int idx, const char* name,
+    lua_Integer* value)
+{
+    lua_getfield(L, idx, name);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        return 0;
+    }
+
+    int isnum = lua_isnumber(L, -1);
+    *value = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    if (!isnum || *value < 0 || (lua_Integer)(uint32_t)*value != *value)
+    {
+        return luaL_error(L, "invalid `%s`", name);
+    }
+
+    return 1;
+}
+
+static int _lpcre2_match_context_new(lua_State* L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+
+    lpcre2_match_context_t* context = lua_newuserdata(L, sizeof(lpcre2_match_context_t));
+    context->context = NULL;
+    context->jit_stack = NULL;
+    pcre2_config(PCRE2_CONFIG_MATCHLIMIT, &context->match_limit);
+    pcre2_config(PCRE2_CONFIG_DEPTHLIMIT, &context->depth_limit);
+    pcre2_config(PCRE2_CONFIG_HEAPLIMIT, &context->heap_limit);
+    context->jit_stack_min = 0;
+    context->jit_stack_max = 0;
+
+    _lpcre2_setmetatable(L, LPCRE2_TYPE_MATCH_CONTEXT);
+
+    lpcre2_allocator_t* allocator = _lpcre2_allocator(L);
+    if ((context->context = pcre2_match_context_create(allocator->gcontext)) == NULL)
+    {
+        return luaL_error(L, "out of memory");
+    }
+
+    lua_Integer value;
+    if (_lpcre2_opt_field(L, 1, "match_limit", &value))
+    {
+        context->match_limit = (uint32_t)value;
+        pcre2_set_match_limit(context->context, context->match_limit);
+    }
+    if (_lpcre2_opt_field(L, 1, "depth_limit", &value))
+    {
+        context->depth_limit = (uint32_t)value;
+        pcre2_set_depth_limit(context->context, context->depth_limit);
+    }
+    if (_lpcre2_opt_field(L, 1, "heap_limit", &value))
+    {
+        context->heap_limit = (uint32_t)value;
+        pcre2_set_heap_limit(context->context, context->heap_limit);
+    }
+
+    lua_getfield(L, 1, "jit_stack");
+    if (!lua_isnil(L, -1))
+    {
+        luaL_argcheck(L, lua_istable(L, -1), 1, "`jit_stack` must be {min, max}");
+
+        lua_Integer stack_min, stack_max;
+        lua_rawgeti(L, -1, 1);
+        stack_min = lua_tointeger(L, -1);
+        lua_rawgeti(L, -2, 2);
+        stack_max = lua_tointeger(L, -1);
+        lua_pop(L, 2);
+
+        luaL_argcheck(L, stack_min > 0 && stack_max >= stack_min, 1,
+            "`jit_stack` must be {min, max}");
+
+        context->jit_stack = pcre2_jit_stack_create((PCRE2_SIZE)stack_min,
+            (PCRE2_SIZE)stack_max, allocator->gcontext);
+        if (context->jit_stack == NULL)
+        {
+            return luaL_error(L, "out of memory");
+        }
+        pcre2_jit_stack_assign(context->context, NULL, context->jit_stack);
+        context->jit_stack_min = (size_t)stack_min;
+        context->jit_stack_max = (size_t)stack_max;
+    }
+    lua_pop(L, 1);
+
+    return 1;
+}
+
+static int _lpcre2_set_match_context(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    lpcre2_match_context_t* context = NULL;
+    if (!lua_isnoneornil(L, 2))
+    {
+        context = _lpcre2_checkudata(L, 2, LPCRE2_TYPE_MATCH_CONTEXT);
+    }
+    lua_settop(L, 2);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, code->mcontext_ref);
+    code->mcontext_ref = LUA_NOREF;
+    code->mcontext = context;
+
+    if (context != NULL)
+    {
+        lua_pushvalue(L, 2);
+        code->mcontext_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Initial DFA workspace size, same as pcre2test.
+ */
+#define LPCRE2_DFA_WSCOUNT      1000
+
+/**
+ * @brief Initial number of matches the DFA match data can hold.
+ */
+#define LPCRE2_DFA_OVECCOUNT    16
+
+static void _lpcre2_dfa_workspace_resize(lua_State* L, lpcre2_code_t* code,
+    size_t wscount)
+{
+    if (wscount > (size_t)-1 / sizeof(int))
+    {
+        luaL_error(L, "out of memory");
+        return;
+    }
+
+    code->dfa_workspace = lua_newuserdata(L, sizeof(int) * wscount);
+    code->dfa_wscount = wscount;
+
+    luaL_unref(L, LUA_REGISTRYINDEX, code->dfa_workspace_ref);
+    code->dfa_workspace_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+static void _lpcre2_dfa_match_data_resize(lua_State* L, lpcre2_code_t* code,
+    uint32_t ovecsize)
+{
+    if (code->dfa_match_data != NULL)
+    {
+        pcre2_match_data_free(code->dfa_match_data);
+        code->dfa_match_data = NULL;
+    }
+
+    code->dfa_match_data = pcre2_match_data_create(ovecsize,
+        _lpcre2_allocator(L)->gcontext);
+    if (code->dfa_match_data == NULL)
+    {
+        luaL_error(L, "out of memory");
+    }
+}
+
+static int _lpcre2_dfa_match(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    size_t subject_sz = 0;
+    const char* subject = _lpcre2_check_subject(L, 2, &subject_sz);
+
+    size_t offset = lua_tointeger(L, 3);
+    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+
+    if (code->dfa_workspace == NULL)
+    {
+        _lpcre2_dfa_workspace_resize(L, code, LPCRE2_DFA_WSCOUNT);
+    }
+    if (code->dfa_match_data == NULL)
+    {
+        _lpcre2_dfa_match_data_resize(L, code, LPCRE2_DFA_OVECCOUNT);
+    }
+
+    int rc;
+    uint64_t start = code->stats != NULL ? _lpcre2_clock_ns() : 0;
+    for (;;)
+    {
+        rc = pcre2_dfa_match(code->code, (PCRE2_SPTR)subject, subject_sz,
+            offset, options, code->dfa_match_data, _lpcre2_code_mcontext(code),
+            code->dfa_workspace, code->dfa_wscount);
+
+        /*
+         * A restarted match continues from the state kept in the workspace,
+         * which is overwritten by the call, so it can never be retried.
+         */
+        if (options & PCRE2_DFA_RESTART)
+        {
+            break;
+        }
+
+        if (rc == PCRE2_ERROR_DFA_WSSIZE)
+        {
+            _lpcre2_dfa_workspace_resize(L, code, code->dfa_wscount * 2);
+        }
+        else if (rc == 0)
+        {
+            _lpcre2_dfa_match_data_resize(L, code,
+                pcre2_get_ovector_count(code->dfa_match_data) * 2);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (code->stats != NULL && code->stats->config->enabled)
+    {
+        _lpcre2_stats_record(code->stats, rc,
+            offset < subject_sz ? subject_sz - offset : 0,
+            _lpcre2_clock_ns() - start);
+    }
+
+    if (rc == PCRE2_ERROR_NOMATCH)
+    {
+        LPCRE2_STATS_FLUSH(L, code);
+        lua_pushnil(L);
+        return 1;
+    }
+    if (rc == PCRE2_ERROR_PARTIAL || LPCRE2_IS_LIMIT_ERROR(rc))
+    {
+        lua_pushboolean(L, 0);
+        lua_pushinteger(L, rc);
+        _lpcre2_push_error(L, rc);
+        LPCRE2_STATS_FLUSH(L, code);
+        return 3;
+    }
+    if (rc < 0)
+    {
+        return _lpcre2_match_error(L, rc);
+    }
+
+    /* Only happens on restart: all slots are used and others are lost. */
+    if (rc == 0)
+    {
+        rc = (int)pcre2_get_ovector_count(code->dfa_match_data);
+    }
+
+    int idx;
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(code->dfa_match_data);
+    luaL_checkstack(L, rc + 1, "too many matches");
+
+    /* All matches start at the same position and the longest comes first. */
+    lua_pushinteger(L, ovector[0] + 1);
+    for (idx = 0; idx < rc; idx++)
+    {
+        lua_pushinteger(L, ovector[2 * idx + 1]);
+    }
+    LPCRE2_STATS_FLUSH(L, code);
+
+    return rc + 1;
+}
+
+static int _lpcre2_new_match_data(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    lpcre2_match_data_create(L, code);
+
+    return 1;
+}
+
+/**
+ * @brief Call pcre2_substitute() with output buffer \p addr of \p outlength
+ *   bytes. On #PCRE2_ERROR_NOMEMORY, \p outlength is set to the required size.
+ */
+static int _lpcre2_substitute_into(lpcre2_code_t* code, const char* subject,
+    size_t length, const char* replacement, size_t rlength, uint32_t options,
+    char* addr, PCRE2_SIZE* outlength)
+{
+    return pcre2_substitute(code->code,
+        (PCRE2_SPTR)subject,
+        length,
+        0,
+        options | PCRE2_SUBSTITUTE_OVERFLOW_LENGTH,
+        NULL,
+        _lpcre2_code_mcontext(code),
+        (PCRE2_SPTR)replacement,
+        rlength,
+        (PCRE2_UCHAR*)addr,
+        outlength);
+}
+
+/**
+ * @brief Same as lpcre2_substitute(), but errors are not raised.
+ * @return The replaced string, or NULL with \p error set to the PCRE2 error
+ *   code.
+ */
+static const char* _lpcre2_substitute_run(lua_State* L, lpcre2_code_t* code,
+    const char* subject, size_t length, const char* replacement, size_t rlength,
+    uint32_t options, size_t* len, int* error)
+{
+    int ret;
+    char* addr;
+    PCRE2_SIZE outlength;
+    luaL_Buffer buf;
+
+    /*
+     * Most of time the result is not much longer than the subject, so try
+     * once with a buffer large enough for that, and only retry with the exact
+     * size if it overflows.
+     */
+#if LUA_VERSION_NUM >= 502
+    outlength = length + rlength;
+    if (outlength < LUAL_BUFFERSIZE)
+    {
+        outlength = LUAL_BUFFERSIZE;
+    }
+    addr = luaL_buffinitsize(L, &buf, outlength);
+#else
+    luaL_buffinit(L, &buf);
+    addr = luaL_prepbuffer(&buf);
+    outlength = LUAL_BUFFERSIZE;
+#endif
+
+    uint64_t start = code->stats != NULL ? _lpcre2_clock_ns() : 0;
+    ret = _lpcre2_substitute_into(code, subject, length, replacement, rlength,
+        options, addr, &outlength);
+
+    int retried = ret == PCRE2_ERROR_NOMEMORY;
+    if (retried)
+    {
+#if LUA_VERSION_NUM >= 502
+        addr = luaL_prepbuffsize(&buf, outlength);
+#else
+        /* Lua 5.1 buffer cannot grow, use a temporary userdata instead. */
+        addr = lua_newuserdata(L, outlength);
+#endif
+        ret = _lpcre2_substitute_into(code, subject, length, replacement,
+            rlength, options, addr, &outlength);
+    }
+
+    if (code->stats != NULL && code->stats->config->enabled)
+    {
+        /* No substitution means no match. */
+        _lpcre2_stats_record(code->stats, ret != 0 ? ret : PCRE2_ERROR_NOMATCH,
+            length, _lpcre2_clock_ns() - start);
+    }
+    if (ret < 0)
+    {
+        *error = ret;
+        return NULL;
+    }
+
+#if LUA_VERSION_NUM < 502
+    if (retried)
+    {
+        lua_pushlstring(L, addr, outlength);
+        lua_remove(L, -2);
+    }
+    else
+#endif
+    {
+        luaL_addsize(&buf, outlength);
+        luaL_pushresult(&buf);
+    }
+    LPCRE2_STATS_FLUSH(L, code);
+
+    return lua_tolstring(L, -1, len);
+}
+
+static int _lpcre2_substitute(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    size_t content_sz = 0;
+    const char* content = _lpcre2_check_subject(L, 2, &content_sz);
+
+    size_t replace_sz = 0;
+    const char* replace = luaL_checklstring(L, 3, &replace_sz);
+
+    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+
+    int error;
+    if (_lpcre2_substitute_run(L, code, content, content_sz, replace,
+        replace_sz, options, NULL, &error) == NULL)
+    {
+        return _lpcre2_match_error(L, error);
+    }
+
+    return 1;
+}
+
+static int _lpcre2_match_many(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    uint32_t options = (uint32_t)lua_tointeger(L, 3);
+    int captures = lua_toboolean(L, 4);
+
+    size_t i, size = lua_rawlen(L, 2);
+    int n = 0;
+    lua_settop(L, 2);
+    lua_createtable(L, captures ? (int)size : 0, 0);
+
+    for (i = 1; i <= size; i++)
+    {
+        lua_rawgeti(L, 2, (int)i);
+
+        size_t subject_sz = 0;
+        const char* subject = _lpcre2_check_subject(L, -1, &subject_sz);
+
+        int rc;
+        pcre2_match_data* match_data = _lpcre2_code_scratch_match(L, code,
+            subject, subject_sz, 0, options, &rc);
+        if (match_data == NULL && rc != PCRE2_ERROR_NOMATCH)
+        {
+            return _lpcre2_match_error(L, rc);
+        }
+
+        if (!captures)
+        {
+            lua_pop(L, 1);
+            if (match_data != NULL)
+            {
+                lua_pushinteger(L, (lua_Integer)i);
+                lua_rawseti(L, 3, ++n);
+            }
+            continue;
+        }
+
+        if (match_data == NULL)
+        {
+            lua_pushboolean(L, 0);
+        }
+        else
+        {
+            int idx;
+            lua_createtable(L, (int)code->capture_count, 1);
+            for (idx = 0; idx <= (int)code->capture_count; idx++)
+            {
+                _lpcre2_push_group(L, subject, match_data, rc, idx);
+                lua_rawseti(L, -2, idx);
+            }
+        }
+        lua_rawseti(L, 3, (int)i);
+        lua_pop(L, 1);
+    }
+
+    return 1;
+}
+
+static int _lpcre2_substitute_many(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    size_t replace_sz = 0;
+    const char* replace = luaL_checklstring(L, 3, &replace_sz);
+
+    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+
+    size_t i, size = lua_rawlen(L, 2);
+    lua_settop(L, 4);
+    lua_createtable(L, (int)size, 0);
+
+    for (i = 1; i <= size; i++)
+    {
+        lua_rawgeti(L, 2, (int)i);
+
+        size_t content_sz = 0;
+        const char* content = _lpcre2_check_subject(L, -1, &content_sz);
+
+        int error;
+        if (_lpcre2_substitute_run(L, code, content, content_sz, replace,
+            replace_sz, options, NULL, &error) == NULL)
+        {
+            return _lpcre2_match_error(L, error);
+        }
+        lua_rawseti(L, 5, (int)i);
+        lua_pop(L, 1);
+    }
+
+    return 1;
+}
+
+static int _lpcre2_code_info(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    size_t jit_size = 0;
+    if (code->jit_options != 0)
+    {
+        pcre2_pattern_info(code->code, PCRE2_INFO_JITSIZE, &jit_size);
+    }
+
+    lua_newtable(L);
+
+    lua_pushboolean(L, code->jit_options != 0);
+    lua_setfield(L, -2, "jit");
+
+    lua_pushinteger(L, code->jit_options);
+    lua_setfield(L, -2, "jit_options");
+
+    lua_pushinteger(L, (lua_Integer)jit_size);
+    lua_setfield(L, -2, "jit_size");
+
+    lua_pushinteger(L, code->options);
+    lua_setfield(L, -2, "options");
+
+    lua_pushinteger(L, code->capture_count);
+    lua_setfield(L, -2, "capture_count");
+
+    lua_pushinteger(L, code->min_length);
+    lua_setfield(L, -2, "min_length");
+
+    if (code->first_unit >= 0)
+    {
+        char unit = (char)code->first_unit;
+        lua_pushlstring(L, &unit, 1);
+        lua_setfield(L, -2, "first_unit");
+    }
+
+    if (code->last_unit >= 0)
+    {
+        char unit = (char)code->last_unit;
+        lua_pushlstring(L, &unit, 1);
+        lua_setfield(L, -2, "last_unit");
+    }
+
+    if (code->literal_length != 0)
+    {
+        lua_pushlstring(L, code->literal, code->literal_length);
+        lua_setfield(L, -2, "literal");
+    }
+
+    lua_newtable(L);
+    const lpcre2_names_t* names = code->names;
+    uint32_t i;
+    for (i = 0; names != NULL && i < names->capacity; i++)
+    {
+        if (names->slots[i].name != NULL)
+        {
+            lua_pushinteger(L, names->numbers[names->slots[i].first]);
+            lua_setfield(L, -2, names->slots[i].name);
+        }
+    }
+    lua_setfield(L, -2, "names");
+
+    return 1;
+}
+
+static int _lpcre2_code_group_index(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    size_t name_sz;
+    const char* name = luaL_checklstring(L, 2, &name_sz);
+
+    const lpcre2_name_t* slot = _lpcre2_names_find(code->names, name, name_sz);
+    if (slot == NULL)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    uint32_t i;
+    luaL_checkstack(L, (int)slot->count, NULL);
+    for (i = 0; i < slot->count; i++)
+    {
+        lua_pushinteger(L, code->names->numbers[slot->first + i]);
+    }
+
+    return (int)slot->count;
+}
+
+static int _lpcre2_match_data_gc(lua_State* L)
+{
+    lpcre2_match_data_impl_t* data = lua_touserdata(L, 1);
+
+    if (data->data != NULL)
+    {
+        pcre2_match_data_free(data->data);
+        data->data = NULL;
+    }
+
+    _lpcre2_names_release(data->names);
+    data->names = NULL;
+
+    return 0;
+}
+
+static int _lpcre2_match_data_iter_gc(lua_State* L)
+{
+    lpcre2_match_data_iter_t* iter = lua_touserdata(L, 1);
+
+    if (iter->data != NULL)
+    {
+        pcre2_match_data_free(iter->data);
+        iter->data = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Create an iterator for \p code and push it on top of \p L.
+ *
+ * The iterator owns its match data, so it is released by GC even if an error
+ * is raised during the iteration.
+ */
+static lpcre2_match_data_iter_t* _lpcre2_iter_new(lua_State* L,
+    lpcre2_code_t* code, size_t offset, uint32_t options)
+{
+    lpcre2_match_data_iter_t* iter = lua_newuserdata(L, sizeof(lpcre2_match_data_iter_t));
+    iter->data = NULL;
+    iter->offset = offset;
+    iter->options = options;
+    iter->last_empty = 0;
+    iter->done = 0;
+
+    _lpcre2_setmetatable(L, LPCRE2_TYPE_MATCH_DATA_ITER);
+
+    if ((iter->data = pcre2_match_data_create_from_pattern(code->code, NULL)) == NULL)
+    {
+        luaL_error(L, "out of memory");
+        return NULL;
+    }
+
+    return iter;
+}
+
+static int _lpcre2_gmatch_next(lua_State* L)
+{
+    lpcre2_match_data_iter_t* iter = lua_touserdata(L, lua_upvalueindex(1));
+    lpcre2_code_t* code = lua_touserdata(L, lua_upvalueindex(2));
+
+    size_t subject_sz = 0;
+    const char* subject = _lpcre2_check_subject(L, lua_upvalueindex(3), &subject_sz);
+
+    int rc = _lpcre2_iter_next(code, subject, subject_sz, iter,
+        _lpcre2_code_mcontext(code));
+    if (rc == PCRE2_ERROR_NOMATCH)
+    {
+        return 0;
+    }
+    if (rc < 0)
+    {
+        return _lpcre2_error(L, rc);
+    }
+
+    int n = _lpcre2_push_captures(L, code, subject, iter->data, rc);
+    LPCRE2_STATS_FLUSH(L, code);
+    return n;
+}
+
+static int _lpcre2_gmatch(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+    size_t subject_sz = 0;
+    _lpcre2_check_subject(L, 2, &subject_sz);
+
+    size_t offset = lua_tointeger(L, 3);
+    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+
+    _lpcre2_iter_new(L, code, offset, options);
+
+    /* upvalues: iterator, code, subject */
+    lua_pushvalue(L, 1);
+    lua_pushvalue(L, 2);
+    lua_pushcclosure(L, _lpcre2_gmatch_next, 3);
+
+    return 1;
+}
+
+/**
+ * @brief Append replacement string \p repl to \p buf, expanding `%0` - `%9`
+ *   to captured groups and `%%` to `%`.
+ */
+static void _lpcre2_gsub_add_string(lua_State* L, luaL_Buffer* buf,
+    const char* repl, size_t repl_sz, lpcre2_code_t* code, const char* subject,
+    pcre2_match_data* match_data, int rc)
+{
+    size_t i;
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(match_data);
+
+    for (i = 0; i < repl_sz; i++)
+    {
+        if (repl[i] != '%')
+        {
+            luaL_addchar(buf, repl[i]);
+            continue;
+        }
+
+        i++;
+        if (i < repl_sz && repl[i] == '%')
+        {
+            luaL_addchar(buf, '%');
+            continue;
+        }
+        if (i >= repl_sz || repl[i] < '0' || repl[i] > '9')
+        {
+            luaL_error(L, "invalid use of '%%' in replacement string");
+            return;
+        }
+
+        /* Like string.gsub(), %1 is the whole match if there is no group. */
+        int idx = repl[i] - '0';
+        if (idx == 1 && code->capture_count == 0)
+        {
+            idx = 0;
+        }
+        else if (idx > (int)code->capture_count)
+        {
+            luaL_error(L, "invalid capture index %%%d in replacement string", idx);
+            return;
+        }
+
+        if (idx < rc && ovector[2 * idx] != PCRE2_UNSET)
+        {
+            luaL_addlstring(buf, subject + ovector[2 * idx],
+                ovector[2 * idx + 1] - ovector[2 * idx]);
+        }
+    }
+}
+
+/**
+ * @brief Append the value from table or function replacement to \p buf.
+ *
+ * Like `string.gsub()`, if the value is false or nil the original match is
+ * kept.
+ */
+static void _lpcre2_gsub_add_value(lua_State* L, luaL_Buffer* buf,
+    lpcre2_code_t* code, const char* subject, pcre2_match_data* match_data,
+    int rc)
+{
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(match_data);
+
+    if (lua_type(L, 3) == LUA_TFUNCTION)
+    {
+        lua_pushvalue(L, 3);
+        int n = _lpcre2_push_captures(L, code, subject, match_data, rc);
+        lua_call(L, n, 1);
+    }
+    else
+    {
+        _lpcre2_push_group(L, subject, match_data, rc,
+            code->capture_count == 0 ? 0 : 1);
+        lua_gettable(L, 3);
+    }
+
+    if (!lua_toboolean(L, -1))
+    {
+        lua_pop(L, 1);
+        luaL_addlstring(buf, subject + ovector[0], ovector[1] - ovector[0]);
+        return;
+    }
+    if (!lua_isstring(L, -1))
+    {
+        luaL_error(L, "invalid replacement value (a %s)", luaL_typename(L, -1));
+        return;
+    }
+
+    luaL_addvalue(buf);
+}
+
+static int _lpcre2_gsub(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    size_t subject_sz = 0;
+    const char* subject = _lpcre2_check_subject(L, 2, &subject_sz);
+
+    int repl_type = lua_type(L, 3);
+    luaL_argcheck(L, repl_type == LUA_TNUMBER || repl_type == LUA_TSTRING
+        || repl_type == LUA_TTABLE || repl_type == LUA_TFUNCTION, 3,
+        "string/function/table expected");
+
+    lua_Integer max = luaL_optinteger(L, 4, -1);
+    uint32_t options = (uint32_t)lua_tointeger(L, 5);
+    lua_settop(L, 5);
+
+    size_t repl_sz = 0;
+    const char* repl = NULL;
+    if (repl_type == LUA_TNUMBER || repl_type == LUA_TSTRING)
+    {
+        repl = lua_tolstring(L, 3, &repl_sz);
+    }
+
+    lpcre2_match_data_iter_t* iter = _lpcre2_iter_new(L, code, 0, options); // sp:6
+
+    int rc;
+    size_t last_end = 0;
+    lua_Integer count = 0;
+
+    luaL_Buffer buf;
+    luaL_buffinit(L, &buf);
+
+    while ((max < 0 || count < max)
+        && (rc = _lpcre2_iter_next(code, subject, subject_sz, iter,
+            _lpcre2_code_mcontext(code))) != PCRE2_ERROR_NOMATCH)
+    {
+        if (rc < 0)
+        {
+            return _lpcre2_match_error(L, rc);
+        }
+
+        PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(iter->data);
+        luaL_addlstring(&buf, subject + last_end, ovector[0] - last_end);
+
+        if (repl != NULL)
+        {
+            _lpcre2_gsub_add_string(L, &buf, repl, repl_sz, code, subject,
+                iter->data, rc);
+        }
+        else
+        {
+            _lpcre2_gsub_add_value(L, &buf, code, subject, iter->data, rc);
+        }
+
+        last_end = ovector[1];
+        count++;
+    }
+
+    luaL_addlstring(&buf, subject + last_end, subject_sz - last_end);
+    luaL_pushresult(&buf);
+    lua_pushinteger(L, count);
+    LPCRE2_STATS_FLUSH(L, code);
+
+    return 2;
+}
+
+/**
+ * @brief Iterate matches over the scratch match data of \p code.
+ */
+static void _lpcre2_scratch_iter_init(lua_State* L, lpcre2_code_t* code,
+    lpcre2_match_data_iter_t* iter, size_t offset, uint32_t options)
+{
+    iter->data = _lpcre2_code_scratch(L, code);
+    iter->offset = offset;
+    iter->options = options;
+    iter->last_empty = 0;
+    iter->done = 0;
+}
+
+static int _lpcre2_split(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    size_t subject_sz = 0;
+    const char* subject = _lpcre2_check_subject(L, 2, &subject_sz);
+
+    lua_Integer max = luaL_optinteger(L, 3, -1);
+    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+
+    lpcre2_match_data_iter_t iter;
+    _lpcre2_scratch_iter_init(L, code, &iter, 0, options);
+
+    int rc, n = 0;
+    size_t last_end = 0;
+    pcre2_match_context* mcontext = _lpcre2_code_mcontext(code);
+
+    lua_newtable(L);
+    while ((max < 0 || n < max)
+        && (rc = _lpcre2_iter_next(code, subject, subject_sz, &iter,
+            mcontext)) != PCRE2_ERROR_NOMATCH)
+    {
+        if (rc < 0)
+        {
+            return _lpcre2_match_error(L, rc);
+        }
+
+        PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(iter.data);
+        lua_pushlstring(L, subject + last_end, ovector[0] - last_end);
+        lua_rawseti(L, -2, ++n);
+        last_end = ovector[1];
+    }
+
+    lua_pushlstring(L, subject + last_end, subject_sz - last_end);
+    lua_rawseti(L, -2, ++n);
+    LPCRE2_STATS_FLUSH(L, code);
+
+    return 1;
+}
+
+static int _lpcre2_count(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    size_t subject_sz = 0;
+    const char* subject = _lpcre2_check_subject(L, 2, &subject_sz);
+
+    size_t offset = lua_tointeger(L, 3);
+    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+
+    lpcre2_match_data_iter_t iter;
+    _lpcre2_scratch_iter_init(L, code, &iter, offset, options);
+
+    int rc;
+    lua_Integer count = 0;
+    pcre2_match_context* mcontext = _lpcre2_code_mcontext(code);
+    while ((rc = _lpcre2_iter_next(code, subject, subject_sz, &iter, mcontext)) >= 0)
+    {
+        count++;
+    }
+    if (rc != PCRE2_ERROR_NOMATCH)
+    {
+        return _lpcre2_match_error(L, rc);
+    }
+    LPCRE2_STATS_FLUSH(L, code);
+
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+/**
+ * @brief Matcher over a stream of chunks.
+ *
+ * Only the tail that a later match may still need is buffered: the part
+ * after the last match (or from the start of a partial match), plus enough
+ * bytes for lookbehinds.
+ */
+typedef struct lpcre2_stream
+{
+    lpcre2_code_t*              code;
+    int                         code_ref;   /**< Registry reference of #lpcre2_stream::code. */
+    lpcre2_allocator_t*         allocator;  /**< Allocator of #lpcre2_stream::buffer. */
+    lpcre2_match_data_iter_t    iter;       /**< Match state, offset is relative to buffer. */
+    char*                       buffer;
+    size_t                      size;       /**< Buffered bytes. */
+    size_t                      capacity;   /**< Capacity of #lpcre2_stream::buffer. */
+    size_t                      base;       /**< Stream offset of buffer[0]. */
+    size_t                      keep;       /**< Bytes kept before next match. */
+    int                         finished;
+} lpcre2_stream_t;
+
+static int _lpcre2_stream_gc(lua_State* L)
+{
+    lpcre2_stream_t* stream = lua_touserdata(L, 1);
+
+    if (stream->buffer != NULL)
+    {
+        stream->allocator->allocf(stream->allocator->ud, stream->buffer,
+            stream->capacity, 0);
+        stream->buffer = NULL;
+        stream->capacity = 0;
+    }
+
+    if (stream->iter.data != NULL)
+    {
+        pcre2_match_data_free(stream->iter.data);
+        stream->iter.data = NULL;
+    }
+
+    luaL_unref(L, LUA_REGISTRYINDEX, stream->code_ref);
+    stream->code_ref = LUA_NOREF;
+
+    return 0;
+}
+
+static lpcre2_stream_t* _lpcre2_stream_check(lua_State* L)
+{
+    lpcre2_stream_t* stream = _lpcre2_checkself(L, LPCRE2_TYPE_STREAM);
+    if (stream->finished)
+    {
+        luaL_error(L, "stream is finished");
+        return NULL;
+    }
+    return stream;
+}
+
+/**
+ * @brief Push a match as `{ [0] = match, beg0, end0, beg1, end1, ... }` with
+ *   1-based inclusive stream offsets.
+ */
+static void _lpcre2_stream_push_match(lua_State* L, lpcre2_stream_t* stream,
+    int rc)
+{
+    int idx;
+    int last = (int)stream->code->capture_count;
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(stream->iter.data);
+
+    lua_createtable(L, 2 * (last + 1), 1);
+    _lpcre2_push_group(L, stream->buffer, stream->iter.data, rc, 0);
+    lua_rawseti(L, -2, 0);
+
+    for (idx = 0; idx <= last; idx++)
+    {
+        if (idx >= rc || ovector[2 * idx] == PCRE2_UNSET)
+        {
+            lua_pushboolean(L, 0);
+            lua_rawseti(L, -2, 2 * idx + 1);
+            lua_pushboolean(L, 0);
+            lua_rawseti(L, -2, 2 * idx + 2);
+            continue;
+        }
+
+        lua_pushinteger(L, stream->base + ovector[2 * idx] + 1);
+        lua_rawseti(L, -2, 2 * idx + 1);
+        lua_pushinteger(L, stream->base + ovector[2 * idx + 1]);
+        lua_rawseti(L, -2, 2 * idx + 2);
+    }
+}
+
+/**
+ * @brief Push a table of all complete matches in buffer, and drop the bytes
+ *   no later match needs.
+ * @param[in] partial   More input may follow.
+ */
+static void _lpcre2_stream_scan(lua_State* L, lpcre2_stream_t* stream,
+    int partial)
+{
+    lpcre2_match_data_iter_t* iter = &stream->iter;
+    uint32_t options = iter->options;
+    int rc, n = 0;
+
+    if (partial)
+    {
+        iter->options |= PCRE2_PARTIAL_HARD;
+    }
+    if (stream->base != 0)
+    {
+        /* buffer[0] is not the start of stream. */
+        iter->options |= PCRE2_NOTBOL;
+    }
+
+    lua_newtable(L);
+    for (;;)
+    {
+        iter->done = 0;
+        rc = _lpcre2_iter_next(stream->code, stream->buffer, stream->size,
+            iter, _lpcre2_code_mcontext(stream->code));
+        if (rc < 0)
+        {
+            break;
+        }
+
+        _lpcre2_stream_push_match(L, stream, rc);
+        lua_rawseti(L, -2, ++n);
+    }
+    iter->options = options;
+
+    if (rc == PCRE2_ERROR_PARTIAL)
+    {
+        /* No match can start before the partial one. */
+        iter->offset = pcre2_get_ovector_pointer(iter->data)[0];
+    }
+    else if (rc == PCRE2_ERROR_NOMATCH)
+    {
+        if (!iter->last_empty && iter->offset < stream->size)
+        {
+            iter->offset = stream->size;
+        }
+    }
+    else
+    {
+        _lpcre2_error(L, rc);
+        return;
+    }
+
+    size_t start = iter->offset < stream->size ? iter->offset : stream->size;
+    if (start <= stream->keep)
+    {
+        return;
+    }
+
+    size_t discard = start - stream->keep;
+    if (stream->code->options & PCRE2_UTF)
+    {
+        while (discard > 0 && (stream->buffer[discard] & 0xc0) == 0x80)
+        {
+            discard--;
+        }
+    }
+
+    memmove(stream->buffer, stream->buffer + discard, stream->size - discard);
+    stream->size -= discard;
+    stream->base += discard;
+    iter->offset -= discard;
+}
+
+static int _lpcre2_stream_feed(lua_State* L)
+{
+    lpcre2_stream_t* stream = _lpcre2_stream_check(L);
+
+    size_t chunk_sz = 0;
+    const char* chunk = luaL_checklstring(L, 2, &chunk_sz);
+
+    if (chunk_sz > stream->capacity - stream->size)
+    {
+        size_t capacity = stream->capacity != 0 ? stream->capacity : LUAL_BUFFERSIZE;
+        while (capacity - stream->size < chunk_sz)
+        {
+            if (capacity > (size_t)-1 / 2)
+            {
+                return luaL_error(L, "out of memory");
+            }
+            capacity *= 2;
+        }
+
+        char* buffer = stream->allocator->allocf(stream->allocator->ud,
+            stream->buffer, stream->capacity, capacity);
+        if (buffer == NULL)
+        {
+            return luaL_error(L, "out of memory");
+        }
+        stream->buffer = buffer;
+        stream->capacity = capacity;
+    }
+
+    memcpy(stream->buffer + stream->size, chunk, chunk_sz);
+    stream->size += chunk_sz;
+
+    _lpcre2_stream_scan(L, stream, 1);
+    LPCRE2_STATS_FLUSH(L, stream->code);
+
+    return 1;
+}
+
+static int _lpcre2_stream_finish(lua_State* L)
+{
+    lpcre2_stream_t* stream = _lpcre2_stream_check(L);
+
+    _lpcre2_stream_scan(L, stream, 0);
+    stream->finished = 1;
+    LPCRE2_STATS_FLUSH(L, stream->code);
+
+    return 1;
+}
+
+static int _lpcre2_stream(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+    uint32_t options = (uint32_t)lua_tointeger(L, 2);
+
+    lpcre2_allocator_t* allocator = _lpcre2_allocator(L);
+
+    lpcre2_stream_t* stream = lua_newuserdata(L, sizeof(lpcre2_stream_t));
+    memset(stream, 0, sizeof(*stream));
+    stream->code = code;
+    stream->code_ref = LUA_NOREF;
+    stream->allocator = allocator;
+    stream->iter.options = options;
+
+    _lpcre2_setmetatable(L, LPCRE2_TYPE_STREAM);
+
+    lua_pushvalue(L, 1);
+    stream->code_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    if ((stream->iter.data = pcre2_match_data_create_from_pattern(code->code, NULL)) == NULL)
+    {
+        return luaL_error(L, "out of memory");
+    }
+
+    /*
+     * Lookbehinds are counted in characters. Also keep the longest newline
+     * sequence, which a multiline ^ checks right before the match.
+     */
+    uint32_t max_lookbehind = 0;
+    pcre2_pattern_info(code->code, PCRE2_INFO_MAXLOOKBEHIND, &max_lookbehind);
+    stream->keep = (size_t)max_lookbehind * ((code->options & PCRE2_UTF) ? 4 : 1) + 3;
+
+    return 1;
+}
+
+/**
+ * @brief Smallest partition worth a thread of its own.
+ */
+#define LPCRE2_PARALLEL_MIN_PART    (64 * 1024)
+
+/**
+ * @brief Max number of threads of count_all() and find_all().
+ */
+#define LPCRE2_PARALLEL_MAX_THREADS 256
+
+/**
+ * @brief Scans one partition of the subject.
+ *
+ * Workers run without the Lua state, so everything they use is created
+ * before they start and released after they are joined, and they only use
+ * malloc() which is thread safe.
+ */
+typedef struct lpcre2_worker
+{
+    lpcre2_code_t*              code;       /**< Shared read-only. */
+    const char*                 subject;
+    size_t                      subject_size;
+    size_t                      begin;      /**< Partition is [begin, end). */
+    size_t                      end;
+    int                         last;       /**< Last partition, may match at the end of subject. */
+    uint32_t                    options;
+    int                         collect;    /**< Collect match offsets. */
+
+    pcre2_match_data*           data;
+    pcre2_match_context*        mcontext;   /**< Copy of the code's context, or a default one. */
+    pcre2_jit_stack*            jit_stack;  /**< JIT stack of this worker, or NULL. */
+
+    size_t                      count;      /**< Number of matches. */
+    size_t*                     offsets;    /**< Begin and end of matches if #lpcre2_worker::collect. */
+    size_t                      capacity;   /**< Capacity of #lpcre2_worker::offsets, in matches. */
+    int                         rc;         /**< PCRE2 error code, or 0. */
+
+    lpcre2_thread_t             thread;
+    int                         started;    /**< Running on #lpcre2_worker::thread. */
+} lpcre2_worker_t;
+
+typedef struct lpcre2_parallel
+{
+    lpcre2_code_t               code;       /**< Copy of the code without stats, used by workers. */
+    size_t                      size;       /**< Number of workers. */
+    lpcre2_worker_t             workers[1];
+} lpcre2_parallel_t;
+
+static void _lpcre2_worker_run(lpcre2_worker_t* worker)
+{
+    lpcre2_match_data_iter_t iter;
+    iter.data = worker->data;
+    iter.offset = worker->begin;
+    iter.options = worker->options;
+    iter.last_empty = 0;
+    iter.done = 0;
+
+    int rc;
+    PCRE2_SIZE* ovector = pcre2_get_ovector_pointer(worker->data);
+    /* Match against the whole subject, so that assertions see past the end of
+     * partition, and only keep matches that start in it. */
+    while ((rc = _lpcre2_iter_next(worker->code, worker->subject,
+        worker->subject_size, &iter, worker->mcontext)) >= 0)
+    {
+        /* An empty match at the end belongs to the next partition. */
+        if (!worker->last && ovector[0] >= worker->end)
+        {
+            break;
+        }
+
+        if (worker->collect)
+        {
+            if (worker->count == worker->capacity)
+            {
+                size_t capacity = worker->capacity != 0 ? worker->capacity * 2 : 64;
+                size_t* offsets = realloc(worker->offsets,
+                    sizeof(size_t) * 2 * capacity);
+                if (offsets == NULL)
+                {
+                    worker->rc = PCRE2_ERROR_NOMEMORY;
+                    return;
+                }
+                worker->offsets = offsets;
+                worker->capacity = capacity;
+            }
+
+            worker->offsets[2 * worker->count] = ovector[0];
+            worker->offsets[2 * worker->count + 1] = ovector[1];
+        }
+        worker->count++;
+    }
+
+    if (rc != PCRE2_ERROR_NOMATCH && rc < 0)
+    {
+        worker->rc = rc;
+    }
+}
+
+#if defined(_WIN32)
+
+static DWORD WINAPI _lpcre2_worker_entry(LPVOID arg)
+{
+    _lpcre2_worker_run(arg);
+    return 0;
+}
+
+static int _lpcre2_worker_start(lpcre2_worker_t* worker)
+{
+    worker->thread = CreateThread(NULL, 0, _lpcre2_worker_entry, worker, 0, NULL);
+    return worker->thread != NULL;
+}
+
+static void _lpcre2_worker_join(lpcre2_worker_t* worker)
+{
+    WaitForSingleObject(worker->thread, INFINITE);
+    CloseHandle(worker->thread);
+}
+
+static size_t _lpcre2_cpu_count(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+}
+
+#else
+
+static void* _lpcre2_worker_entry(void* arg)
+{
+    _lpcre2_worker_run(arg);
+    return NULL;
+}
+
+static int _lpcre2_worker_start(lpcre2_worker_t* worker)
+{
+    return pthread_create(&worker->thread, NULL, _lpcre2_worker_entry, worker) == 0;
+}
+
+static void _lpcre2_worker_join(lpcre2_worker_t* worker)
+{
+    pthread_join(worker->thread, NULL);
+}
+
+static size_t _lpcre2_cpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t)count : 1;
+}
+
+#endif
+
+static int _lpcre2_parallel_gc(lua_State* L)
+{
+    lpcre2_parallel_t* parallel = lua_touserdata(L, 1);
+
+    size_t i;
+    for (i = 0; i < parallel->size; i++)
+    {
+        lpcre2_worker_t* worker = &parallel->workers[i];
+
+        if (worker->started)
+        {
+            _lpcre2_worker_join(worker);
+            worker->started = 0;
+        }
+        if (worker->data != NULL)
+        {
+            pcre2_match_data_free(worker->data);
+            worker->data = NULL;
+        }
+        if (worker->mcontext != NULL)
+        {
+            pcre2_match_context_free(worker->mcontext);
+            worker->mcontext = NULL;
+        }
+        if (worker->jit_stack != NULL)
+        {
+            pcre2_jit_stack_free(worker->jit_stack);
+            worker->jit_stack = NULL;
+        }
+        free(worker->offsets);
+        worker->offsets = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Find the end of first \p delim at or after \p offset.
+ * @return The offset after the delimiter, or \p length if not found.
+ */
+static size_t _lpcre2_find_delim(const char* subject, size_t length,
+    size_t offset, const char* delim, size_t delim_sz)
+{
+    while (offset + delim_sz <= length)
+    {
+        const char* pos = memchr(subject + offset, delim[0],
+            length - offset - delim_sz + 1);
+        if (pos == NULL)
+        {
+            break;
+        }
+
+        offset = pos - subject;
+        if (memcmp(pos, delim, delim_sz) == 0)
+        {
+            return offset + delim_sz;
+        }
+        offset++;
+    }
+
+    return length;
+}
+
+/**
+ * @brief Create workers for count_all() and find_all() at stack top.
+ *
+ * Arguments are `code, subject[, { threads = N, split = DELIM, options = N }]`.
+ */
+static lpcre2_parallel_t* _lpcre2_parallel_new(lua_State* L, int collect)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+
+    size_t subject_sz = 0;
+    const char* subject = _lpcre2_check_subject(L, 2, &subject_sz);
+
+    size_t threads = _lpcre2_cpu_count();
+    uint32_t options = 0;
+    const char* delim = "\n";
+    size_t delim_sz = 1;
+
+    if (!lua_isnoneornil(L, 3))
+    {
+        luaL_checktype(L, 3, LUA_TTABLE);
+
+        lua_Integer value;
+        if (_lpcre2_opt_field(L, 3, "threads", &value))
+        {
+            luaL_argcheck(L, value > 0, 3, "`threads` must be positive");
+            threads = (size_t)value;
+        }
+        if (_lpcre2_opt_field(L, 3, "options", &value))
+        {
+            options = (uint32_t)value;
+        }
+
+        lua_getfield(L, 3, "split");
+        if (!lua_isnil(L, -1))
+        {
+            delim = lua_tolstring(L, -1, &delim_sz);
+            luaL_argcheck(L, delim != NULL && delim_sz != 0, 3,
+                "`split` must be a non-empty string");
+        }
+        /* Keep the delimiter on stack. */
+    }
+    lua_settop(L, 4);
+
+    if (threads > LPCRE2_PARALLEL_MAX_THREADS)
+    {
+        threads = LPCRE2_PARALLEL_MAX_THREADS;
+    }
+    if (threads > subject_sz / LPCRE2_PARALLEL_MIN_PART)
+    {
+        threads = subject_sz / LPCRE2_PARALLEL_MIN_PART;
+    }
+    if (threads == 0)
+    {
+        threads = 1;
+    }
+
+    lpcre2_parallel_t* parallel = lua_newuserdata(L,
+        sizeof(lpcre2_parallel_t) + sizeof(lpcre2_worker_t) * (threads - 1));
+    memset(parallel, 0, sizeof(lpcre2_parallel_t) + sizeof(lpcre2_worker_t) * (threads - 1));
+
+    _lpcre2_setmetatable(L, LPCRE2_TYPE_PARALLEL);
+
+    /*
+     * Workers must not update the counters of an instrumented code, and the
+     * copy does not own the group names.
+     */
+    parallel->code = *code;
+    parallel->code.stats = NULL;
+    parallel->code.names = NULL;
+
+    /* An empty subject still has one empty partition. */
+    size_t i, begin = 0;
+    lpcre2_match_context_t* context = code->mcontext;
+    for (i = 0; i < threads && (i == 0 || begin < subject_sz); i++)
+    {
+        lpcre2_worker_t* worker = &parallel->workers[i];
+        parallel->size++;
+
+        worker->code = &parallel->code;
+        worker->subject = subject;
+        worker->subject_size = subject_sz;
+        worker->begin = begin;
+        worker->end = i == threads - 1 ? subject_sz
+            : _lpcre2_find_delim(subject, subject_sz,
+                begin + (subject_sz - begin) / (threads - i), delim, delim_sz);
+        worker->last = worker->end == subject_sz;
+        worker->options = options;
+        worker->collect = collect;
+        begin = worker->end;
+
+        /* Not created from the pattern, as its memory belongs to Lua. */
+        if ((worker->data = pcre2_match_data_create(code->capture_count + 1, NULL)) == NULL)
+        {
+            luaL_error(L, "out of memory");
+            return NULL;
+        }
+
+        /* Without a context, the interpreter may allocate its heap frames
+         * with the allocator of the pattern, which is not thread safe. */
+        if ((worker->mcontext = pcre2_match_context_create(NULL)) == NULL)
+        {
+            luaL_error(L, "out of memory");
+            return NULL;
+        }
+        if (context == NULL)
+        {
+            continue;
+        }
+
+        pcre2_set_match_limit(worker->mcontext, context->match_limit);
+        pcre2_set_depth_limit(worker->mcontext, context->depth_limit);
+        pcre2_set_heap_limit(worker->mcontext, context->heap_limit);
+
+        if (context->jit_stack_min != 0)
+        {
+            worker->jit_stack = pcre2_jit_stack_create(context->jit_stack_min,
+                context->jit_stack_max, NULL);
+            if (worker->jit_stack == NULL)
+            {
+                luaL_error(L, "out of memory");
+                return NULL;
+            }
+            pcre2_jit_stack_assign(worker->mcontext, NULL, worker->jit_stack);
+        }
+    }
+
+    return parallel;
+}
+
+/**
+ * @brief Run all workers.
+ * @return The first error in subject order, or 0.
+ */
+static int _lpcre2_parallel_run(lpcre2_parallel_t* parallel)
+{
+    size_t i;
+
+    /* If a thread cannot be created, the worker runs on this thread instead. */
+    for (i = 1; i < parallel->size; i++)
+    {
+        parallel->workers[i].started = _lpcre2_worker_start(&parallel->workers[i]);
+    }
+    _lpcre2_worker_run(&parallel->workers[0]);
+
+    for (i = 1; i < parallel->size; i++)
+    {
+        lpcre2_worker_t* worker = &parallel->workers[i];
+        if (worker->started)
+        {
+            _lpcre2_worker_join(worker);
+            worker->started = 0;
+        }
+        else
+        {
+            _lpcre2_worker_run(worker);
+        }
+    }
+
+    for (i = 0; i < parallel->size; i++)
+    {
+        if (parallel->workers[i].rc < 0)
+        {
+            return parallel->workers[i].rc;
+        }
+    }
+
+    return 0;
+}
+
+static int _lpcre2_count_all(lua_State* L)
+{
+    lpcre2_parallel_t* parallel = _lpcre2_parallel_new(L, 0);
+
+    int rc = _lpcre2_parallel_run(parallel);
+    if (rc < 0)
+    {
+        return _lpcre2_match_error(L, rc);
+    }
+
+    size_t i, count = 0;
+    for (i = 0; i < parallel->size; i++)
+    {
+        count += parallel->workers[i].count;
+    }
+
+    lua_pushinteger(L, (lua_Integer)count);
+    return 1;
+}
+
+static int _lpcre2_find_all(lua_State* L)
+{
+    lpcre2_parallel_t* parallel = _lpcre2_parallel_new(L, 1);
+
+    int rc = _lpcre2_parallel_run(parallel);
+    if (rc < 0)
+    {
+        return _lpcre2_match_error(L, rc);
+    }
+
+    size_t i, j, count = 0;
+    for (i = 0; i < parallel->size; i++)
+    {
+        count += parallel->workers[i].count;
+    }
+
+    /* Same as match_offsets(): 1-based and inclusive. */
+    int n = 0;
+    lua_createtable(L, (int)(2 * count), 0);
+    for (i = 0; i < parallel->size; i++)
+    {
+        lpcre2_worker_t* worker = &parallel->workers[i];
+        for (j = 0; j < worker->count; j++)
+        {
+            lua_pushinteger(L, (lua_Integer)worker->offsets[2 * j] + 1);
+            lua_rawseti(L, -2, ++n);
+            lua_pushinteger(L, (lua_Integer)worker->offsets[2 * j + 1]);
+            lua_rawseti(L, -2, ++n);
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Create an empty code object and push it on top of \p L.
+ */
+static lpcre2_code_t* _lpcre2_code_new(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, LPCRE2_STATS_NAME);
+    lpcre2_stats_config_t* config = NULL;
+    if (lua_istable(L, -1))
+    {
+        lua_getfield(L, -1, "config");
+        config = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        if (!config->enabled)
+        {
+            config = NULL;
+        }
+    }
+
+    /* Counters of an instrumented code are allocated together with it. */
+    lpcre2_code_t* code = lua_newuserdata(L, sizeof(lpcre2_code_t)
+        + (config != NULL ? sizeof(lpcre2_stats_t) : 0));
+    _lpcre2_code_init(code);
+
+    _lpcre2_setmetatable(L, LPCRE2_TYPE_CODE);
+
+    if (config != NULL)
+    {
+        code->stats = (lpcre2_stats_t*)(code + 1);
+        memset(code->stats, 0, sizeof(lpcre2_stats_t));
+        code->stats->config = config;
+
+        /* stats.codes[lightuserdata(code)] = code */
+        lua_getfield(L, -2, "codes");
+        lua_pushlightuserdata(L, code);
+        lua_pushvalue(L, -3);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+    }
+    lua_remove(L, -2);
+
+    return code;
+}
+
+/**
+ * @brief Cache pattern information and JIT compile \p code->code.
+ */
+static void _lpcre2_code_setup(lua_State* L, lpcre2_code_t* code,
+    uint32_t jit_options)
+{
+    code->names = _lpcre2_names_new(L, code->code);
+
+    pcre2_pattern_info(code->code, PCRE2_INFO_ALLOPTIONS, &code->options);
+    pcre2_pattern_info(code->code, PCRE2_INFO_CAPTURECOUNT, &code->capture_count);
+
+    uint32_t newline = 0;
+    pcre2_pattern_info(code->code, PCRE2_INFO_NEWLINE, &newline);
+    code->crlf_is_newline = newline == PCRE2_NEWLINE_ANY
+        || newline == PCRE2_NEWLINE_CRLF || newline == PCRE2_NEWLINE_ANYCRLF;
+
+    /*
+     * Only ASCII code units are used for prefilter: other bytes may be part
+     * of a caseless UTF character, or match caseless by Unicode properties.
+     */
+    uint32_t type = 0, unit = 0;
+    pcre2_pattern_info(code->code, PCRE2_INFO_MINLENGTH, &code->min_length);
+    pcre2_pattern_info(code->code, PCRE2_INFO_FIRSTCODETYPE, &type);
+    pcre2_pattern_info(code->code, PCRE2_INFO_FIRSTCODEUNIT, &unit);
+    code->first_unit = (type == 1 && unit < 0x80) ? (int)unit : -1;
+    pcre2_pattern_info(code->code, PCRE2_INFO_LASTCODETYPE, &type);
+    pcre2_pattern_info(code->code, PCRE2_INFO_LASTCODEUNIT, &unit);
+    code->last_unit = (type == 1 && unit < 0x80) ? (int)unit : -1;
+
+    /*
+     * JIT is an optimization only. If it is not available on this platform,
+     * or the pattern is too complex, the interpreter is still used.
+     */
+    if (jit_options != 0 && pcre2_jit_compile(code->code, jit_options) == 0)
+    {
+        code->jit_options = jit_options;
+    }
+}
+
+/**
+ * @brief Rough frequency of \p unit in text, to pick the unit of a literal
+ *   that memchr() stops at least often.
+ */
+static int _lpcre2_unit_rank(char unit)
+{
+    static const char s_common[] = "etaoinsrhldcumfpgwybvkxjqz";
+    if (unit == ' ')
+    {
+        return 64;
+    }
+    if (unit >= 'a' && unit <= 'z')
+    {
+        return 63 - (int)(strchr(s_common, unit) - s_common);
+    }
+    if (unit >= '0' && unit <= '9')
+    {
+        return 30;
+    }
+    return 0;
+}
+
+/**
+ * @brief Find the literal that starts every match of \p pattern, for the
+ *   prefilter of _lpcre2_code_may_match().
+ *
+ * This is a conservative scan, not a parser: it gives up on any alternation,
+ * on caseless or extended patterns, and stops at the first metacharacter or
+ * escape sequence that is not a quoted punctuation character. A unit followed
+ * by a quantifier that allows zero repetitions is not required, so it is not
+ * part of the literal.
+ */
+/**
+ * @brief Use \p literal of \p length units as the literal of \p code, and
+ *   pick its rarest unit for memchr().
+ */
+static void _lpcre2_code_use_literal(lpcre2_code_t* code, const char* literal,
+    size_t length)
+{
+    size_t i, rare = 0;
+
+    /* A single unit is already checked by first_unit. */
+    if (length < 2)
+    {
+        return;
+    }
+    memcpy(code->literal, literal, length);
+    code->literal_length = (uint32_t)length;
+
+    for (i = 1; i < length; i++)
+    {
+        if (_lpcre2_unit_rank(literal[i]) <= _lpcre2_unit_rank(literal[rare]))
+        {
+            rare = i;
+        }
+    }
+    code->literal_rare = (uint32_t)rare;
+}
+
+static void _lpcre2_code_set_literal(lpcre2_code_t* code, const char* pattern,
+    size_t length)
+{
+    size_t i = 0, n = 0;
+    code->literal_length = 0;
+    code->literal_rare = 0;
+
+    if (code->options & (PCRE2_CASELESS | PCRE2_EXTENDED | PCRE2_EXTENDED_MORE))
+    {
+        return;
+    }
+
+    if (code->options & PCRE2_LITERAL)
+    {
+        _lpcre2_code_use_literal(code, pattern,
+            length < LPCRE2_LITERAL_MAX ? length : LPCRE2_LITERAL_MAX);
+        return;
+    }
+
+    if (memchr(pattern, '|', length) != NULL)
+    {
+        return;
+    }
+
+    if (length != 0 && pattern[0] == '^')
+    {
+        i++;
+    }
+
+    char literal[LPCRE2_LITERAL_MAX];
+    while (i < length && n < LPCRE2_LITERAL_MAX)
+    {
+        char c = pattern[i];
+        if (c == '\\')
+        {
+            /* Only an escaped ASCII punctuation character is a literal. */
+            c = i + 1 < length ? pattern[i + 1] : '\0';
+            if (!((c >= '!' && c <= '/') || (c >= ':' && c <= '@')
+                || (c >= '[' && c <= '`') || (c >= '{' && c <= '~')))
+            {
+                break;
+            }
+            i += 2;
+        }
+        else if (strchr("^$.[]()?*+{}", c) == NULL)
+        {
+            i++;
+        }
+        else
+        {
+            break;
+        }
+
+        if (i < length && (pattern[i] == '?' || pattern[i] == '*' || pattern[i] == '{'))
+        {
+            break;
+        }
+        literal[n++] = c;
+    }
+
+    _lpcre2_code_use_literal(code, literal, n);
+}
+
+static int _lpcre2_set_gc(lua_State* L)
+{
+    size_t i;
+    lpcre2_set_t* set = lua_touserdata(L, 1);
+
+    for (i = 0; i < set->size; i++)
+    {
+        _lpcre2_code_release(&set->codes[i]);
+    }
+
+    if (set->data != NULL)
+    {
+        pcre2_match_data_free(set->data);
+        set->data = NULL;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Check if pattern \p idx in \p set matches \p subject.
+ *
+ * Once the whole subject passed a UTF check, #PCRE2_NO_UTF_CHECK is added to
+ * \p options so it is not checked again by remaining patterns.
+ */
+static int _lpcre2_set_match_one(lua_State* L, lpcre2_set_t* set, size_t idx,
+    const char* subject, size_t length, size_t offset, uint32_t* options)
+{
+    lpcre2_code_t* code = &set->codes[idx];
+
+    /* The ovector only holds the whole match, so 0 also means match. */
+    int rc = _lpcre2_pcre2_match(code, subject, length, offset, *options,
+        set->data, NULL);
+    if (rc >= 0 || rc == PCRE2_ERROR_NOMATCH)
+    {
+        if ((code->options & PCRE2_UTF) && offset == 0)
+        {
+            *options |= PCRE2_NO_UTF_CHECK;
+        }
+    }
+    if (rc == PCRE2_ERROR_NOMATCH)
+    {
+        return 0;
+    }
+    if (rc < 0)
+    {
+        PCRE2_UCHAR message[256];
+        pcre2_get_error_message(rc, message, sizeof(message) / sizeof(PCRE2_UCHAR));
+        return luaL_error(L, "pattern %d: %s", (int)idx + 1, message);
+    }
+
+    return 1;
+}
+
+static int _lpcre2_set_match(lua_State* L)
+{
+    lpcre2_set_t* set = _lpcre2_checkself(L, LPCRE2_TYPE_SET);
+
+    size_t subject_sz = 0;
+    const char* subject = _lpcre2_check_subject(L, 2, &subject_sz);
+
+    size_t offset = lua_tointeger(L, 3);
+    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+
+    size_t i;
+    int n = 0;
+    lua_newtable(L);
+    for (i = 0; i < set->size; i++)
+    {
+        if (_lpcre2_set_match_one(L, set, i, subject, subject_sz, offset, &options))
+        {
+            lua_pushinteger(L, (lua_Integer)i + 1);
+            lua_rawseti(L, -2, ++n);
+        }
+    }
+
+    return 1;
+}
+
+static int _lpcre2_set_first(lua_State* L)
+{
+    lpcre2_set_t* set = _lpcre2_checkself(L, LPCRE2_TYPE_SET);
+
+    size_t subject_sz = 0;
+    const char* subject = _lpcre2_check_subject(L, 2, &subject_sz);
+
+    size_t offset = lua_tointeger(L, 3);
+    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+
+    size_t i;
+    for (i = 0; i < set->size; i++)
+    {
+        if (_lpcre2_set_match_one(L, set, i, subject, subject_sz, offset, &options))
+        {
+            lua_pushinteger(L, (lua_Integer)i + 1);
+            return 1;
+        }
+    }
+
+    lua_pushnil(L);
+    return 1;
+}
+
+static int _lpcre2_set_size(lua_State* L)
+{
+    lpcre2_set_t* set = _lpcre2_checkself(L, LPCRE2_TYPE_SET);
+
+    lua_pushinteger(L, (lua_Integer)set->size);
+    return 1;
+}
+
+static int _lpcre2_set_new(lua_State* L)
+{
+    size_t i;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    uint32_t options = (uint32_t)lua_tointeger(L, 2);
+    uint32_t jit_options = (uint32_t)luaL_optinteger(L, 3, PCRE2_JIT_COMPLETE);
+    lua_settop(L, 3);
+
+    size_t size = lua_rawlen(L, 1);
+
+    lpcre2_set_t* set = lua_newuserdata(L,
+        sizeof(lpcre2_set_t) + sizeof(lpcre2_code_t) * size);
+    set->data = NULL;
+    set->size = size;
+    for (i = 0; i < size; i++)
+    {
+        _lpcre2_code_init(&set->codes[i]);
+    }
+
+    _lpcre2_setmetatable(L, LPCRE2_TYPE_SET);
+
+    lpcre2_allocator_t* allocator = _lpcre2_allocator(L);
+    if ((set->data = pcre2_match_data_create(1, allocator->gcontext)) == NULL)
+    {
+        return luaL_error(L, "out of memory");
+    }
+
+    for (i = 0; i < size; i++)
+    {
+        lua_rawgeti(L, 1, (int)i + 1);
+
+        size_t pattern_sz = 0;
+        const char* pattern = lua_tolstring(L, -1, &pattern_sz);
+        if (pattern == NULL)
+        {
+            return luaL_error(L, "pattern %d is not a string", (int)i + 1);
+        }
+
+        lpcre2_code_t* code = &set->codes[i];
+
+        int errcode;
+        PCRE2_SIZE erroffset;
+        code->code = pcre2_compile((PCRE2_SPTR)pattern,
+            pattern_sz,
+            options,
+            &errcode,
+            &erroffset,
+            allocator->ccontext);
+        if (code->code == NULL)
+        {
+            PCRE2_UCHAR message[256];
+            pcre2_get_error_message(errcode, message, sizeof(message) / sizeof(PCRE2_UCHAR));
+            return luaL_error(L, "compile pattern %d error at %d: %s",
+                (int)i + 1, (int)erroffset, message);
+        }
+        _lpcre2_code_setup(L, code, jit_options);
+        _lpcre2_code_set_literal(code, pattern, pattern_sz);
+
+        lua_pop(L, 1);
+    }
+
+    return 1;
+}
+
+static void _lpcre2_cache_unlink(lpcre2_cache_t* cache, lpcre2_code_t* code)
+{
+    if (code->cache_prev != NULL)
+    {
+        code->cache_prev->cache_next = code->cache_next;
+    }
+    else
+    {
+        cache->head = code->cache_next;
+    }
+
+    if (code->cache_next != NULL)
+    {
+        code->cache_next->cache_prev = code->cache_prev;
+    }
+    else
+    {
+        cache->tail = code->cache_prev;
+    }
+
+    code->cache_prev = NULL;
+    code->cache_next = NULL;
+}
+
+static void _lpcre2_cache_push_front(lpcre2_cache_t* cache, lpcre2_code_t* code)
+{
+    code->cache_prev = NULL;
+    code->cache_next = cache->head;
+
+    if (cache->head != NULL)
+    {
+        cache->head->cache_prev = code;
+    }
+    else
+    {
+        cache->tail = code;
+    }
+    cache->head = code;
+}
+
+/**
+ * @brief Evict least recently used codes until cache fits its capacity.
+ * @note Must be called from a library function that has cache upvalues.
+ */
+static void _lpcre2_cache_trim(lua_State* L, lpcre2_cache_t* cache)
+{
+    while (cache->size > cache->capacity)
+    {
+        lpcre2_code_t* code = cache->tail;
+        _lpcre2_cache_unlink(cache, code);
+        cache->size--;
+        cache->evictions++;
+
+        /* keys[codes[code]] = nil */
+        lua_pushlightuserdata(L, code);
+        lua_rawget(L, LPCRE2_UPVALUE_CACHE_CODES);
+        lua_pushnil(L);
+        lua_rawset(L, LPCRE2_UPVALUE_CACHE_KEYS);
+
+        /* codes[code] = nil */
+        lua_pushlightuserdata(L, code);
+        lua_pushnil(L);
+        lua_rawset(L, LPCRE2_UPVALUE_CACHE_CODES);
+    }
+}
+
+/**
+ * @brief Push the message of compile error \p errcode of \p pattern.
+ */
+static void _lpcre2_push_compile_error(lua_State* L, const char* pattern,
+    size_t length, int errcode, PCRE2_SIZE erroffset)
+{
+    PCRE2_UCHAR message[256];
+    pcre2_get_error_message(errcode, message, sizeof(message) / sizeof(PCRE2_UCHAR));
+
+    /* The pattern has an explicit length, and is not NUL terminated. */
+    lua_pushliteral(L, "compile pattern `");
+    lua_pushlstring(L, pattern, length);
+    lua_pushfstring(L, "` error at %d: %s", (int)erroffset, (const char*)message);
+    lua_concat(L, 3);
+}
+
+/**
+ * @brief Compile \p pattern and push the code object on top of \p L.
+ * @return The code, or NULL with the error message pushed instead and
+ *   \p errcode set.
+ */
+static lpcre2_code_t* _lpcre2_code_compile(lua_State* L, const char* pattern,
+    size_t length, uint32_t options, uint32_t jit_options, int* errcode)
+{
+    lpcre2_allocator_t* allocator = _lpcre2_allocator(L);
+    lpcre2_code_t* code = _lpcre2_code_new(L);
+
+    PCRE2_SIZE erroffset;
+    code->code = pcre2_compile((PCRE2_SPTR)pattern,
+        length,
+        options,
+        errcode,
+        &erroffset,
+        allocator->ccontext);
+    if (code->code == NULL)
+    {
+        lua_pop(L, 1);
+        _lpcre2_push_compile_error(L, pattern, length, *errcode, erroffset);
+        return NULL;
+    }
+
+    _lpcre2_code_setup(L, code, jit_options);
+    _lpcre2_code_set_literal(code, pattern, length);
+
+    return code;
+}
+
+/**
+ * @brief Same as _lpcre2_code_compile(), but the compiled pattern comes from
+ *   the shared registry.
+ */
+static lpcre2_code_t* _lpcre2_code_compile_shared(lua_State* L,
+    const char* pattern, size_t length, uint32_t options, uint32_t jit_options,
+    int* errcode)
+{
+    lpcre2_code_t* code = _lpcre2_code_new(L);
+
+    PCRE2_SIZE erroffset;
+    lpcre2_shared_code_t* shared = _lpcre2_shared_acquire(pattern, length,
+        options, jit_options, errcode, &erroffset);
+    if (shared == NULL)
+    {
+        if (*errcode == PCRE2_ERROR_NOMEMORY)
+        {
+            luaL_error(L, "out of memory");
+            return NULL;
+        }
+        lua_pop(L, 1);
+        _lpcre2_push_compile_error(L, pattern, length, *errcode, erroffset);
+        return NULL;
+    }
+    code->shared = shared;
+    code->code = shared->code;
+
+    /* JIT compile was done once by the registry. */
+    _lpcre2_code_setup(L, code, 0);
+    code->jit_options = shared->jit_options;
+    _lpcre2_code_set_literal(code, pattern, length);
+
+    return code;
+}
+
+static int _lpcre2_compile(lua_State* L)
+{
+    lpcre2_cache_t* cache = lua_touserdata(L, LPCRE2_UPVALUE_CACHE);
+
+    size_t pattern_sz = 0;
+    const char* pattern = luaL_checklstring(L, 1, &pattern_sz);
+
+    uint32_t options = (uint32_t)lua_tointeger(L, 2);
+    uint32_t jit_options = (uint32_t)luaL_optinteger(L, 3, PCRE2_JIT_COMPLETE);
+
+    int errcode;
+    if (cache->capacity == 0)
+    {
+        if (_lpcre2_code_compile(L, pattern, pattern_sz, options, jit_options,
+            &errcode) == NULL)
+        {
+            return _lpcre2_fail(L, errcode);
+        }
+        return 1;
+    }
+    lua_settop(L, 3);
+
+    /* Cache key: options, jit_options, pattern. */
+    luaL_Buffer buf;
+    luaL_buffinit(L, &buf);
+    luaL_addlstring(&buf, (const char*)&options, sizeof(options));
+    luaL_addlstring(&buf, (const char*)&jit_options, sizeof(jit_options));
+    luaL_addlstring(&buf, pattern, pattern_sz);
+    luaL_pushresult(&buf); // sp:4
+
+    lua_pushvalue(L, 4);
+    lua_rawget(L, LPCRE2_UPVALUE_CACHE_KEYS); // sp:5
+    if (!lua_isnil(L, 5))
+    {
+        lpcre2_code_t* code = lua_touserdata(L, 5);
+        _lpcre2_cache_unlink(cache, code);
+        _lpcre2_cache_push_front(cache, code);
+        cache->hits++;
+        return 1;
+    }
+    lua_pop(L, 1);
+    cache->misses++;
+
+    lpcre2_code_t* code = _lpcre2_code_compile(L, pattern, pattern_sz,
+        options, jit_options, &errcode); // sp:5
+    if (code == NULL)
+    {
+        return _lpcre2_fail(L, errcode);
+    }
+
+    /* keys[key] = code */
+    lua_pushvalue(L, 4);
+    lua_pushvalue(L, 5);
+    lua_rawset(L, LPCRE2_UPVALUE_CACHE_KEYS);
+
+    /* codes[code] = key */
+    lua_pushlightuserdata(L, code);
+    lua_pushvalue(L, 4);
+    lua_rawset(L, LPCRE2_UPVALUE_CACHE_CODES);
+
+    _lpcre2_cache_push_front(cache, code);
+    cache->size++;
+    _lpcre2_cache_trim(L, cache);
+
+    return 1;
+}
+
+static int _lpcre2_cache_size(lua_State* L)
+{
+    lpcre2_cache_t* cache = lua_touserdata(L, LPCRE2_UPVALUE_CACHE);
+
+    if (!lua_isnoneornil(L, 1))
+    {
+        lua_Integer capacity = luaL_checkinteger(L, 1);
+        luaL_argcheck(L, capacity >= 0, 1, "cache size must not be negative");
+
+        cache->capacity = (size_t)capacity;
+        _lpcre2_cache_trim(L, cache);
+    }
+
+    lua_pushinteger(L, (lua_Integer)cache->capacity);
+    return 1;
+}
+
+static int _lpcre2_raise_errors(lua_State* L)
+{
+    if (!lua_isnoneornil(L, 1))
+    {
+        luaL_checktype(L, 1, LUA_TBOOLEAN);
+        lua_pushboolean(L, lua_toboolean(L, 1));
+        lua_setfield(L, LUA_REGISTRYINDEX, LPCRE2_RAISE_NAME);
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LPCRE2_RAISE_NAME);
+    lua_pushboolean(L, lua_isnil(L, -1) || lua_toboolean(L, -1));
+    return 1;
+}
+
+static int _lpcre2_cache_stats(lua_State* L)
+{
+    lpcre2_cache_t* cache = lua_touserdata(L, LPCRE2_UPVALUE_CACHE);
+
+    lua_newtable(L);
+
+    lua_pushinteger(L, (lua_Integer)cache->size);
+    lua_setfield(L, -2, "size");
+
+    lua_pushinteger(L, (lua_Integer)cache->capacity);
+    lua_setfield(L, -2, "capacity");
+
+    lua_pushinteger(L, (lua_Integer)cache->hits);
+    lua_setfield(L, -2, "hits");
+
+    lua_pushinteger(L, (lua_Integer)cache->misses);
+    lua_setfield(L, -2, "misses");
+
+    lua_pushinteger(L, (lua_Integer)cache->evictions);
+    lua_setfield(L, -2, "evictions");
+
+    return 1;
+}
+
+static int _lpcre2_compile_shared(lua_State* L)
+{
+    size_t pattern_sz = 0;
+    const char* pattern = luaL_checklstring(L, 1, &pattern_sz);
+
+    uint32_t options = (uint32_t)lua_tointeger(L, 2);
+    uint32_t jit_options = (uint32_t)luaL_optinteger(L, 3, PCRE2_JIT_COMPLETE);
+
+    int errcode;
+    if (_lpcre2_code_compile_shared(L, pattern, pattern_sz, options,
+        jit_options, &errcode) == NULL)
+    {
+        return _lpcre2_fail(L, errcode);
+    }
+    return 1;
+}
+
+static int _lpcre2_shared_stats(lua_State* L)
+{
+    _lpcre2_shared_lock();
+    size_t size = s_lpcre2_shared.size;
+    size_t references = s_lpcre2_shared.references;
+    _lpcre2_shared_unlock();
+
+    lua_newtable(L);
+
+    lua_pushinteger(L, (lua_Integer)size);
+    lua_setfield(L, -2, "size");
+
+    lua_pushinteger(L, (lua_Integer)references);
+    lua_setfield(L, -2, "references");
+
+    return 1;
+}
+
+/**
+ * @brief Push the instrumentation table of \p L, creating it on first use.
+ * @return Settings in the table.
+ */
+static lpcre2_stats_config_t* _lpcre2_stats_registry(lua_State* L)
+{
+    lpcre2_stats_config_t* config;
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LPCRE2_STATS_NAME);
+    if (!lua_isnil(L, -1))
+    {
+        lua_getfield(L, -1, "config");
+        config = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return config;
+    }
+    lua_pop(L, 1);
+
+    lua_createtable(L, 0, 3);
+
+    config = lua_newuserdata(L, sizeof(lpcre2_stats_config_t));
+    memset(config, 0, sizeof(*config));
+    lua_setfield(L, -2, "config");
+
+    /* Instrumented codes by address, not kept alive by this table. */
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "v");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, -2, "codes");
+
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LPCRE2_STATS_NAME);
+
+    return config;
+}
+
+static void _lpcre2_stats_flush(lua_State* L, lpcre2_code_t* code)
+{
+    lpcre2_stats_t* stats = code->stats;
+    if (stats->slow_ns == 0)
+    {
+        return;
+    }
+
+    uint64_t elapsed = stats->slow_ns;
+    size_t length = stats->slow_length;
+    stats->slow_ns = 0;
+    if (stats->config->reporting)
+    {
+        return;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LPCRE2_STATS_NAME);
+    lua_getfield(L, -1, "on_slow");
+    if (!lua_isfunction(L, -1))
+    {
+        lua_pop(L, 2);
+        return;
+    }
+
+    /* on_slow(code, seconds, length) */
+    lua_getfield(L, -2, "codes");
+    lua_pushlightuserdata(L, code);
+    lua_rawget(L, -2);
+    lua_remove(L, -2);
+    lua_pushnumber(L, (lua_Number)elapsed / 1e9);
+    lua_pushinteger(L, (lua_Integer)length);
+
+    /*
+     * The caller may still use the scratch match data, and the callback may
+     * match with the same code, so hide it during the call.
+     */
+    pcre2_match_data* scratch = code->match_data;
+    code->match_data = NULL;
+    stats->config->reporting = 1;
+    int ret = lua_pcall(L, 3, 0, 0);
+    stats->config->reporting = 0;
+    if (code->match_data != NULL)
+    {
+        pcre2_match_data_free(code->match_data);
+    }
+    code->match_data = scratch;
+
+    if (ret != 0)
+    {
+        lua_remove(L, -2);
+        lua_error(L);
+        return;
+    }
+    lua_pop(L, 1);
+}
+
+static void _lpcre2_stats_push(lua_State* L, const lpcre2_stats_t* stats)
+{
+    lua_createtable(L, 0, 8);
+
+    lua_pushinteger(L, (lua_Integer)stats->calls);
+    lua_setfield(L, -2, "calls");
+
+    lua_pushinteger(L, (lua_Integer)stats->hits);
+    lua_setfield(L, -2, "hits");
+
+    lua_pushinteger(L, (lua_Integer)stats->misses);
+    lua_setfield(L, -2, "misses");
+
+    lua_pushinteger(L, (lua_Integer)stats->errors);
+    lua_setfield(L, -2, "errors");
+
+    lua_pushinteger(L, (lua_Integer)stats->bytes);
+    lua_setfield(L, -2, "bytes");
+
+    lua_pushnumber(L, (lua_Number)stats->total_ns / 1e9);
+    lua_setfield(L, -2, "total_time");
+
+    lua_pushnumber(L, (lua_Number)stats->max_ns / 1e9);
+    lua_setfield(L, -2, "max_time");
+
+    int i;
+    lua_createtable(L, LPCRE2_STATS_HISTOGRAM_SIZE, 0);
+    for (i = 0; i < LPCRE2_STATS_HISTOGRAM_SIZE; i++)
+    {
+        lua_pushinteger(L, (lua_Integer)stats->histogram[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "histogram");
+}
+
+static int _lpcre2_instrument(lua_State* L)
+{
+    int enabled = 1;
+    lua_Number threshold = 0;
+
+    if (lua_istable(L, 1))
+    {
+        lua_settop(L, 1);
+
+        lua_getfield(L, 1, "enabled");
+        enabled = lua_isnil(L, -1) || lua_toboolean(L, -1);
+
+        lua_getfield(L, 1, "slow_threshold");
+        if (!lua_isnil(L, 3))
+        {
+            luaL_argcheck(L, lua_type(L, 3) == LUA_TNUMBER && lua_tonumber(L, 3) >= 0,
+                1, "`slow_threshold` must be a non-negative number");
+            threshold = lua_tonumber(L, 3);
+        }
+
+        lua_getfield(L, 1, "on_slow");
+        if (!lua_isnil(L, -1))
+        {
+            luaL_argcheck(L, lua_isfunction(L, -1), 1, "`on_slow` must be a function");
+        }
+    }
+    else
+    {
+        enabled = lua_toboolean(L, 1);
+        lua_settop(L, 1);
+        lua_pushnil(L);
+        lua_pushnil(L);
+        lua_pushnil(L); // sp:4 on_slow
+    }
+
+    lpcre2_stats_config_t* config = _lpcre2_stats_registry(L); // sp:5
+    config->enabled = enabled;
+    config->slow_ns = (!lua_isnil(L, 4) && threshold > 0)
+        ? (uint64_t)(threshold * 1e9) : 0;
+
+    lua_pushvalue(L, 4);
+    lua_setfield(L, 5, "on_slow");
+
+    return 0;
+}
+
+static int _lpcre2_stats_compare(const void* a, const void* b)
+{
+    const lpcre2_code_t* ca = *(lpcre2_code_t* const*)a;
+    const lpcre2_code_t* cb = *(lpcre2_code_t* const*)b;
+    if (ca->stats->total_ns != cb->stats->total_ns)
+    {
+        return ca->stats->total_ns > cb->stats->total_ns ? -1 : 1;
+    }
+    return 0;
+}
+
+static int _lpcre2_stats(lua_State* L)
+{
+    lua_settop(L, 0);
+    lua_newtable(L); // sp:1
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LPCRE2_STATS_NAME); // sp:2
+    if (lua_isnil(L, 2))
+    {
+        lua_pop(L, 1);
+        return 1;
+    }
+    lua_getfield(L, 2, "codes"); // sp:3
+
+    size_t i, size = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 3) != 0)
+    {
+        size++;
+        lua_pop(L, 1);
+    }
+
+    lpcre2_code_t** codes = lua_newuserdata(L, sizeof(lpcre2_code_t*) * (size + 1)); // sp:4
+    size = 0;
+    lua_pushnil(L);
+    while (lua_next(L, 3) != 0)
+    {
+        codes[size++] = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+    }
+
+    /* The most expensive codes come first. */
+    qsort(codes, size, sizeof(lpcre2_code_t*), _lpcre2_stats_compare);
 
-    uint32_t options = (uint32_t)lua_tointeger(L, 4);
+    for (i = 0; i < size; i++)
+    {
+        _lpcre2_stats_push(L, codes[i]->stats);
+        lua_pushlightuserdata(L, codes[i]);
+        lua_rawget(L, 3);
+        lua_setfield(L, -2, "code");
+        lua_rawseti(L, 1, (int)i + 1);
+    }
+
+    lua_settop(L, 1);
+    return 1;
+}
 
-    lpcre2_substitute(L, code, content, content_sz, replace, replace_sz,
-        options, NULL);
+static int _lpcre2_code_stats(lua_State* L)
+{
+    lpcre2_code_t* code = _lpcre2_checkself(L, LPCRE2_TYPE_CODE);
+    if (code->stats == NULL)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
 
+    _lpcre2_stats_push(L, code->stats);
     return 1;
 }
 
-static int _lpcre2_match_data_gc(lua_State* L)
+static int _lpcre2_serialize(lua_State* L)
 {
-    lpcre2_match_data_impl_t* data = lua_touserdata(L, 1);
+    size_t i;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
 
-    if (data->data != NULL)
+    size_t number = lua_rawlen(L, 1);
+
+    lpcre2_code_t** codes = lua_newuserdata(L, sizeof(lpcre2_code_t*) * (number + 1));
+    for (i = 0; i < number; i++)
     {
-        pcre2_match_data_free(data->data);
-        data->data = NULL;
+        lua_rawgeti(L, 1, (int)i + 1);
+        codes[i] = _lpcre2_checkudata(L, -1, LPCRE2_TYPE_CODE);
+        lua_pop(L, 1);
     }
 
-    return 0;
+    lpcre2_serialize(L, codes, number, NULL);
+
+    return 1;
 }
 
-static int _lpcre2_compile(lua_State* L)
+static int _lpcre2_deserialize(lua_State* L)
 {
-    size_t pattern_sz = 0;
-    const char* pattern = luaL_checklstring(L, 1, &pattern_sz);
-
-    uint32_t options = (uint32_t)lua_tointeger(L, 2);
+    size_t bytes_sz = 0;
+    const char* bytes = luaL_checklstring(L, 1, &bytes_sz);
 
-    lpcre2_compile(L, pattern, pattern_sz, options);
+    lpcre2_deserialize(L, bytes, bytes_sz);
 
     return 1;
 }
@@ -176,6 +4557,7 @@ static void _lpcre2_set_options(lua_State* L)
     lua_setfield(L, -2, #OPT_PCRE2);
 
     LPCRE2_OPTION_MAP(LLCRE2_SET_OPTION);
+    LPCRE2_ERROR_MAP(LLCRE2_SET_OPTION);
 
 #undef LLCRE2_SET_OPTION
 }
@@ -186,11 +4568,40 @@ int luaopen_lpcre2(lua_State* L)
     luaL_checkversion(L);
 #endif
 
+    _lpcre2_allocator(L);
+
+    int type;
+    for (type = 0; type < LPCRE2_TYPE_MAX; type++)
+    {
+        _lpcre2_push_metatable(L, (lpcre2_type_t)type);
+        lua_pop(L, 1);
+    }
+
     static const luaL_Reg pcre2_apis[] = {
-        { "compile",    _lpcre2_compile },
-        { NULL,         NULL }
+        { "buffer",         _lpcre2_buffer },
+        { "cache_size",     _lpcre2_cache_size },
+        { "cache_stats",    _lpcre2_cache_stats },
+        { "compile",        _lpcre2_compile },
+        { "compile_shared", _lpcre2_compile_shared },
+        { "deserialize",    _lpcre2_deserialize },
+        { "instrument",     _lpcre2_instrument },
+        { "mapfile",        _lpcre2_mapfile },
+        { "match_context",  _lpcre2_match_context_new },
+        { "raise_errors",   _lpcre2_raise_errors },
+        { "serialize",      _lpcre2_serialize },
+        { "set",            _lpcre2_set_new },
+        { "shared_stats",   _lpcre2_shared_stats },
+        { "stats",          _lpcre2_stats },
+        { NULL,             NULL }
     };
-    luaL_newlib(L, pcre2_apis);
+    luaL_newlibtable(L, pcre2_apis);
+
+    /* upvalues: cache, cache keys, cache codes */
+    lpcre2_cache_t* cache = lua_newuserdata(L, sizeof(lpcre2_cache_t));
+    memset(cache, 0, sizeof(*cache));
+    lua_newtable(L);
+    lua_newtable(L);
+    luaL_setfuncs(L, pcre2_apis, 3);
 
     _lpcre2_set_options(L);
 
@@ -200,125 +4611,238 @@ int luaopen_lpcre2(lua_State* L)
 lpcre2_code_t* lpcre2_compile(lua_State* L, const char* pattern,
     size_t length, uint32_t options)
 {
-    lpcre2_code_t* code = lua_newuserdata(L, sizeof(lpcre2_code_t));
-    code->code = NULL;
+    return lpcre2_compile_ex(L, pattern, length, options, PCRE2_JIT_COMPLETE);
+}
 
-    static const luaL_Reg s_meta[] = {
-        { "__gc",   _lpcre2_code_gc },
-        { NULL,     NULL },
-    };
-    static const luaL_Reg s_method[] = {
-        { "match",      _lpcre2_match },
-        { "substitute", _lpcre2_substitute },
-        { NULL,         NULL },
-    };
-    if (luaL_newmetatable(L, LPCRE2_CODE_NAME) != 0)
+lpcre2_code_t* lpcre2_compile_ex(lua_State* L, const char* pattern,
+    size_t length, uint32_t options, uint32_t jit_options)
+{
+    int errcode;
+    lpcre2_code_t* code = _lpcre2_code_compile(L, pattern, length, options,
+        jit_options, &errcode);
+    if (code == NULL)
     {
-        luaL_setfuncs(L, s_meta, 0);
-
-        /* metatable.__index = s_method */
-        luaL_newlib(L, s_method);
-        lua_setfield(L, -2, "__index");
+        lua_error(L);
     }
-    lua_setmetatable(L, -2);
 
+    return code;
+}
+
+lpcre2_code_t* lpcre2_compile_shared(lua_State* L, const char* pattern,
+    size_t length, uint32_t options, uint32_t jit_options)
+{
     int errcode;
-    PCRE2_SIZE erroffset;
-    code->code = pcre2_compile((PCRE2_SPTR)pattern,
-        length,
-        options,
-        &errcode,
-        &erroffset,
-        NULL);
-    if (code->code == NULL)
+    lpcre2_code_t* code = _lpcre2_code_compile_shared(L, pattern, length,
+        options, jit_options, &errcode);
+    if (code == NULL)
     {
-        pcre2_get_error_message(errcode, code->message,
-            sizeof(code->message) / sizeof(PCRE2_UCHAR));
-        luaL_error(L, "compile pattern `%s` error at %d: %s",
-            pattern, (int)erroffset, code->message);
-        return NULL;
+        lua_error(L);
     }
 
     return code;
 }
 
-const char* lpcre2_substitute(lua_State* L, lpcre2_code_t* code,
-    const char* subject, size_t length, const char* replacement, size_t rlength,
-    uint32_t options, size_t* len)
+/**
+ * @brief Header of serialized codes, followed by a
+ *   #lpcre2_serialized_code_t for each code, and then the output of
+ *   pcre2_serialize_encode().
+ */
+typedef struct lpcre2_serialized_header
 {
-    int ret;
-    char* addr;
+    char        magic[4];   /**< #LPCRE2_SERIALIZED_MAGIC */
+    uint32_t    number;     /**< Number of codes. */
+    uint64_t    size;       /**< Size of the output of pcre2_serialize_encode(). */
+} lpcre2_serialized_header_t;
 
-    PCRE2_SIZE outlength = 0;
-    ret = pcre2_substitute(code->code,
-        (PCRE2_SPTR)subject,
-        length,
-        0,
-        options | PCRE2_SUBSTITUTE_OVERFLOW_LENGTH,
-        NULL,
-        NULL,
-        (PCRE2_SPTR)replacement,
-        rlength,
-        NULL,
-        &outlength);
-    if (ret != PCRE2_ERROR_NOMEMORY)
+#define LPCRE2_SERIALIZED_MAGIC     "LPC2"
+
+/**
+ * @brief What is saved of a code besides its PCRE2 data.
+ */
+typedef struct lpcre2_serialized_code
+{
+    uint32_t    jit_options;
+    uint32_t    literal_length;
+    char        literal[LPCRE2_LITERAL_MAX];    /**< Literal of the prefilter. */
+} lpcre2_serialized_code_t;
+
+/**
+ * @brief JIT options that can be saved with a code.
+ */
+#define LPCRE2_SERIALIZED_JIT_OPTIONS   \
+    (PCRE2_JIT_COMPLETE | PCRE2_JIT_PARTIAL_SOFT | PCRE2_JIT_PARTIAL_HARD)
+
+/**
+ * @brief Size of header and codes, aligned to 8 bytes so that PCRE2 data is
+ *   properly aligned.
+ */
+#define LPCRE2_SERIALIZED_HEADER_SIZE(number)   \
+    ((sizeof(lpcre2_serialized_header_t) + sizeof(lpcre2_serialized_code_t) * (number) + 7) & ~(size_t)7)
+
+const char* lpcre2_serialize(lua_State* L, lpcre2_code_t** codes,
+    size_t number, size_t* len)
+{
+    size_t i;
+    if (number > INT32_MAX)
     {
-        goto error;
+        luaL_error(L, "too many codes");
+        return NULL;
     }
 
-    luaL_Buffer buf;
+    /* Use userdata for temporary memory so it is not leaked on error. */
+    size_t header_sz = LPCRE2_SERIALIZED_HEADER_SIZE(number);
+    lpcre2_serialized_header_t* header = lua_newuserdata(L, header_sz);
+    memset(header, 0, header_sz);
+    memcpy(header->magic, LPCRE2_SERIALIZED_MAGIC, sizeof(header->magic));
+    header->number = (uint32_t)number;
 
-#if LUA_VERSION_NUM >= 502
-    addr = luaL_buffinitsize(L, &buf, outlength);
-#else
-    luaL_buffinit(L, &buf);
-    if ((addr = malloc(outlength)) == NULL)
+    lpcre2_serialized_code_t* saved = (lpcre2_serialized_code_t*)(header + 1);
+    const pcre2_code** list = lua_newuserdata(L, sizeof(pcre2_code*) * (number + 1));
+    for (i = 0; i < number; i++)
     {
-        luaL_error(L, "not enough memory");
-        return NULL;
+        list[i] = codes[i]->code;
+        saved[i].jit_options = codes[i]->jit_options;
+        saved[i].literal_length = codes[i]->literal_length;
+        memcpy(saved[i].literal, codes[i]->literal, codes[i]->literal_length);
     }
-#endif
 
-    ret = pcre2_substitute(code->code,
-        (PCRE2_SPTR)subject,
-        length,
-        0,
-        options,
-        NULL,
-        NULL,
-        (PCRE2_SPTR)replacement,
-        rlength,
-        (PCRE2_UCHAR*)addr,
-        &outlength);
+    /* PCRE2 refuses to encode nothing. */
+    uint8_t* bytes = NULL;
+    PCRE2_SIZE bytes_sz = 0;
+    if (number != 0)
+    {
+        int32_t ret = pcre2_serialize_encode(list, (int32_t)number, &bytes,
+            &bytes_sz, _lpcre2_allocator(L)->gcontext);
+        if (ret < 0)
+        {
+            _lpcre2_error(L, ret);
+            return NULL;
+        }
+    }
+    lua_pop(L, 1);
+
+    header->size = bytes_sz;
+    lua_pushlstring(L, (const char*)header, header_sz);
+    if (bytes != NULL)
+    {
+        lua_pushlstring(L, (const char*)bytes, bytes_sz);
+        pcre2_serialize_free(bytes);
+        lua_concat(L, 2);
+    }
+    lua_remove(L, -2);
+
+    return lua_tolstring(L, -1, len);
+}
+
+size_t lpcre2_deserialize(lua_State* L, const char* bytes, size_t length)
+{
+    size_t i;
+    const lpcre2_serialized_header_t* header = (const lpcre2_serialized_header_t*)bytes;
+
+    /* PCRE2 trusts the sizes inside its own data, so the whole payload must be
+     * present before it is decoded. */
+    if (length < sizeof(*header)
+        || memcmp(header->magic, LPCRE2_SERIALIZED_MAGIC, sizeof(header->magic)) != 0
+        || header->number > INT32_MAX
+        || length < LPCRE2_SERIALIZED_HEADER_SIZE(header->number)
+        || length - LPCRE2_SERIALIZED_HEADER_SIZE(header->number) != header->size)
+    {
+        luaL_error(L, "invalid serialized data");
+        return 0;
+    }
+
+    size_t number = header->number;
+    const lpcre2_serialized_code_t* saved = (const lpcre2_serialized_code_t*)(header + 1);
+    const uint8_t* data = (const uint8_t*)bytes + LPCRE2_SERIALIZED_HEADER_SIZE(number);
+
+    for (i = 0; i < number; i++)
+    {
+        if ((saved[i].jit_options & ~(uint32_t)LPCRE2_SERIALIZED_JIT_OPTIONS) != 0
+            || saved[i].literal_length > LPCRE2_LITERAL_MAX)
+        {
+            luaL_error(L, "invalid serialized data");
+            return 0;
+        }
+    }
+
+    if (number == 0)
+    {
+        lua_newtable(L);
+        return 0;
+    }
+
+    int32_t ret = pcre2_serialize_get_number_of_codes(data);
     if (ret < 0)
     {
-        goto error;
+        _lpcre2_error(L, ret);
+        return 0;
+    }
+    if ((size_t)ret != number)
+    {
+        luaL_error(L, "invalid serialized data");
+        return 0;
     }
 
-#if LUA_VERSION_NUM >= 502
-    luaL_addsize(&buf, outlength);
-#else
-    luaL_addlstring(&buf, addr, outlength);
-    free(addr); addr = NULL;
-#endif
+    /* Create all code objects first so decoded codes are never leaked. */
+    lua_createtable(L, (int)number, 0);
+    for (i = 0; i < number; i++)
+    {
+        _lpcre2_code_new(L);
+        lua_rawseti(L, -2, (int)i + 1);
+    }
 
-    luaL_pushresult(&buf);
+    pcre2_code** list = lua_newuserdata(L, sizeof(pcre2_code*) * (number + 1));
+    ret = pcre2_serialize_decode(list, (int32_t)number, data,
+        _lpcre2_allocator(L)->gcontext);
+    if (ret < 0)
+    {
+        _lpcre2_error(L, ret);
+        return 0;
+    }
 
-    return lua_tolstring(L, -1, len);
+    /* Hand every decoded code to its object before anything may raise. */
+    for (i = 0; i < number; i++)
+    {
+        lua_rawgeti(L, -2, (int)i + 1);
+        lpcre2_code_t* code = lua_touserdata(L, -1);
+        code->code = list[i];
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
 
-error:
-    pcre2_get_error_message(ret, code->message,
-        sizeof(code->message) / sizeof(PCRE2_UCHAR));
-    luaL_error(L, "%s", code->message);
-    return NULL;
+    for (i = 0; i < number; i++)
+    {
+        lua_rawgeti(L, -1, (int)i + 1);
+        lpcre2_code_t* code = lua_touserdata(L, -1);
+        _lpcre2_code_setup(L, code, saved[i].jit_options);
+        _lpcre2_code_use_literal(code, saved[i].literal, saved[i].literal_length);
+        lua_pop(L, 1);
+    }
+
+    return number;
+}
+
+const char* lpcre2_substitute(lua_State* L, lpcre2_code_t* code,
+    const char* subject, size_t length, const char* replacement, size_t rlength,
+    uint32_t options, size_t* len)
+{
+    int error;
+    const char* ret = _lpcre2_substitute_run(L, code, subject, length,
+        replacement, rlength, options, len, &error);
+    if (ret == NULL)
+    {
+        _lpcre2_error(L, error);
+    }
+
+    return ret;
 }
 
 static int _lpcre2_match_group(lua_State* L)
 {
-    lpcre2_match_data_impl_t* match_data = luaL_checkudata(L, 1, LPCRE2_MATCH_DATA_NAME);
+    lpcre2_match_data_impl_t* match_data = _lpcre2_checkself(L, LPCRE2_TYPE_MATCH_DATA);
 
     size_t content_sz;
-    const char* content = luaL_checklstring(L, 2, &content_sz);
+    const char* content = _lpcre2_check_subject(L, 2, &content_sz);
 
     int idx = (int)luaL_checkinteger(L, 3);
 
@@ -338,12 +4862,12 @@ static int _lpcre2_match_group(lua_State* L)
 static int _lpcre2_match_all_groups(lua_State* L)
 {
     int idx;
-    lua_settop(L, 2);
+    lua_settop(L, 3);
 
-    lpcre2_match_data_impl_t* match_data = luaL_checkudata(L, 1, LPCRE2_MATCH_DATA_NAME);
+    lpcre2_match_data_impl_t* match_data = _lpcre2_checkself(L, LPCRE2_TYPE_MATCH_DATA);
 
     size_t content_sz;
-    const char* content = luaL_checklstring(L, 2, &content_sz);
+    const char* content = _lpcre2_check_subject(L, 2, &content_sz);
 
     lua_newtable(L); // sp:3
     for (idx = 0; idx <= match_data->base.rc; idx++)
@@ -357,12 +4881,60 @@ static int _lpcre2_match_all_groups(lua_State* L)
         lua_seti(L, -2, idx);
     }
 
+    const lpcre2_names_t* names = match_data->names;
+    if (lua_toboolean(L, 3) && names != NULL)
+    {
+        uint32_t i;
+        for (i = 0; i < names->capacity; i++)
+        {
+            const lpcre2_name_t* slot = &names->slots[i];
+            if (slot->name == NULL
+                || (idx = _lpcre2_names_first_set(names, slot, match_data)) < 0)
+            {
+                continue;
+            }
+
+            lua_rawgeti(L, -1, idx);
+            lua_setfield(L, -2, slot->name);
+        }
+    }
+
+    return 1;
+}
+
+static int _lpcre2_match_named(lua_State* L)
+{
+    lpcre2_match_data_impl_t* match_data = _lpcre2_checkself(L, LPCRE2_TYPE_MATCH_DATA);
+
+    size_t content_sz;
+    const char* content = _lpcre2_check_subject(L, 2, &content_sz);
+
+    size_t name_sz;
+    const char* name = luaL_checklstring(L, 3, &name_sz);
+
+    const lpcre2_name_t* slot = _lpcre2_names_find(match_data->names, name, name_sz);
+    if (slot == NULL)
+    {
+        return luaL_error(L, "unknown group name `%s`", name);
+    }
+
+    int idx = _lpcre2_names_first_set(match_data->names, slot, match_data);
+    if (idx < 0)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    size_t len = 0;
+    size_t offset = lpcre2_match_data_ovector(L, &match_data->base, idx, &len);
+
+    lua_pushlstring(L, content + offset, len);
     return 1;
 }
 
 static int _lpcre2_match_group_count(lua_State* L)
 {
-    lpcre2_match_data_impl_t* match_data = luaL_checkudata(L, 1, LPCRE2_MATCH_DATA_NAME);
+    lpcre2_match_data_impl_t* match_data = _lpcre2_checkself(L, LPCRE2_TYPE_MATCH_DATA);
 
     lua_pushinteger(L, match_data->base.rc);
     return 1;
@@ -370,7 +4942,7 @@ static int _lpcre2_match_group_count(lua_State* L)
 
 static int _lpcre2_match_group_offset(lua_State* L)
 {
-    lpcre2_match_data_impl_t* match_data = luaL_checkudata(L, 1, LPCRE2_MATCH_DATA_NAME);
+    lpcre2_match_data_impl_t* match_data = _lpcre2_checkself(L, LPCRE2_TYPE_MATCH_DATA);
 
     lua_Integer group_idx = luaL_checkinteger(L, 2);
     if (group_idx < 0 || group_idx > match_data->base.rc)
@@ -386,63 +4958,78 @@ static int _lpcre2_match_group_offset(lua_State* L)
     return 2;
 }
 
-lpcre2_match_data_t* lpcre2_match(lua_State* L, lpcre2_code_t* code,
-    const char* subject, size_t length, size_t offset, uint32_t options)
+lpcre2_match_data_t* lpcre2_match_data_create(lua_State* L, lpcre2_code_t* code)
 {
-    lpcre2_match_data_impl_t* data = lua_newuserdata(L, sizeof(lpcre2_match_data_impl_t));
+    lpcre2_allocator_t* allocator = _lpcre2_allocator(L);
+    size_t size = allocator->match_data_size
+        + 2 * sizeof(PCRE2_SIZE) * (code->capture_count + 1);
+
+    lpcre2_match_data_impl_t* data = lua_newuserdata(L,
+        offsetof(lpcre2_match_data_impl_t, block) + sizeof(lpcre2_alloc_header_t) + size);
+    data->base.rc = -1;
     data->data = NULL;
+    data->names = NULL;
 
-    static const luaL_Reg s_meta[] = {
-        { "__gc",       _lpcre2_match_data_gc },
-        { NULL,         NULL },
-    };
-    static const luaL_Reg s_method[] = {
-        { "all_groups",     _lpcre2_match_all_groups },
-        { "group",          _lpcre2_match_group },
-        { "group_count",    _lpcre2_match_group_count },
-        { "group_offset",   _lpcre2_match_group_offset },
-        { NULL,             NULL },
-    };
-    if (luaL_newmetatable(L, LPCRE2_MATCH_DATA_NAME) != 0)
-    {
-        luaL_setfuncs(L, s_meta, 0);
+    _lpcre2_setmetatable(L, LPCRE2_TYPE_MATCH_DATA);
 
-        /* metatable.__index = s_method */
-        luaL_newlib(L, s_method);
-        lua_setfield(L, -2, "__index");
-    }
-    lua_setmetatable(L, -2);
+    /* Only heap frames of the interpreter are allocated separately. */
+    data->block->size = 0;
+    allocator->inline_block = data->block;
+    allocator->inline_size = size;
+    data->data = pcre2_match_data_create(code->capture_count + 1, allocator->gcontext);
+    allocator->inline_block = NULL;
 
-    if ((data->data = pcre2_match_data_create_from_pattern(code->code, NULL)) == NULL)
+    /* How PCRE2 allocates match data is not documented, so the block is only
+     * kept if the match data itself was placed in it. */
+    if (data->data != NULL && data->data != (pcre2_match_data*)(data->block + 1)
+        && data->block->size == LPCRE2_ALLOC_INLINE)
+    {
+        pcre2_match_data_free(data->data);
+        data->block->size = 0;
+        data->data = pcre2_match_data_create(code->capture_count + 1, allocator->gcontext);
+    }
+    if (data->data == NULL)
     {
         luaL_error(L, "out of memory");
         return NULL;
     }
 
-    data->base.rc = pcre2_match(code->code,
-        (PCRE2_SPTR)subject,
-        length,
-        offset,
-        options,
-        data->data,
-        NULL);
-    if (data->base.rc < 0)
+    return &data->base;
+}
+
+lpcre2_match_data_t* lpcre2_match_into(lua_State* L, lpcre2_code_t* code,
+    const char* subject, size_t length, size_t offset, uint32_t options,
+    lpcre2_match_data_t* match_data)
+{
+    int error;
+    lpcre2_match_data_t* ret = _lpcre2_match_into(L, code, subject, length,
+        offset, options, match_data, _lpcre2_code_mcontext(code), &error);
+    if (error != 0)
+    {
+        _lpcre2_error(L, error);
+    }
+
+    return ret;
+}
+
+lpcre2_match_data_t* lpcre2_match(lua_State* L, lpcre2_code_t* code,
+    const char* subject, size_t length, size_t offset, uint32_t options)
+{
+    lpcre2_match_data_t* data = lpcre2_match_data_create(L, code);
+
+    if (lpcre2_match_into(L, code, subject, length, offset, options, data) == NULL)
     {
-        if (data->base.rc == PCRE2_ERROR_NOMATCH)
+        int rc = data->rc;
+        lua_pop(L, 1);
+
+        if (rc != PCRE2_ERROR_NOMATCH)
         {
-            lua_pop(L, 1);
-            return NULL;
+            _lpcre2_error(L, rc);
         }
-
-        pcre2_get_error_message(data->base.rc, code->message,
-            sizeof(code->message) / sizeof(PCRE2_UCHAR));
-        luaL_error(L, "%s", code->message);
         return NULL;
     }
 
-    data->base.rc--;
-
-    return &data->base;
+    return data;
 }
 
 size_t lpcre2_match_data_ovector(lua_State* L, lpcre2_match_data_t* match_data,
@@ -467,3 +5054,130 @@ size_t lpcre2_match_data_ovector(lua_State* L, lpcre2_match_data_t* match_data,
 
     return beg_off;
 }
+
+static const luaL_Reg s_lpcre2_code_meta[] = {
+    { "__gc",   _lpcre2_code_gc },
+    { NULL,     NULL },
+};
+
+static const luaL_Reg s_lpcre2_code_method[] = {
+    { "count",             _lpcre2_count },
+    { "count_all",         _lpcre2_count_all },
+    { "dfa_match",         _lpcre2_dfa_match },
+    { "find_all",          _lpcre2_find_all },
+    { "gmatch",            _lpcre2_gmatch },
+    { "gsub",              _lpcre2_gsub },
+    { "group_index",       _lpcre2_code_group_index },
+    { "info",              _lpcre2_code_info },
+    { "match",             _lpcre2_match },
+    { "match_captures",    _lpcre2_match_captures },
+    { "match_many",        _lpcre2_match_many },
+    { "match_offsets",     _lpcre2_match_offsets },
+    { "new_match_data",    _lpcre2_new_match_data },
+    { "set_match_context", _lpcre2_set_match_context },
+    { "split",             _lpcre2_split },
+    { "stats",             _lpcre2_code_stats },
+    { "stream",            _lpcre2_stream },
+    { "substitute",        _lpcre2_substitute },
+    { "substitute_many",   _lpcre2_substitute_many },
+    { NULL,                NULL },
+};
+
+static const luaL_Reg s_lpcre2_match_data_meta[] = {
+    { "__gc",       _lpcre2_match_data_gc },
+    { NULL,         NULL },
+};
+
+static const luaL_Reg s_lpcre2_match_data_method[] = {
+    { "all_groups",     _lpcre2_match_all_groups },
+    { "group",          _lpcre2_match_group },
+    { "group_count",    _lpcre2_match_group_count },
+    { "group_offset",   _lpcre2_match_group_offset },
+    { "named",          _lpcre2_match_named },
+    { NULL,             NULL },
+};
+
+static const luaL_Reg s_lpcre2_match_data_iter_meta[] = {
+    { "__gc",       _lpcre2_match_data_iter_gc },
+    { NULL,         NULL },
+};
+
+static const luaL_Reg s_lpcre2_set_meta[] = {
+    { "__gc",       _lpcre2_set_gc },
+    { NULL,         NULL },
+};
+
+static const luaL_Reg s_lpcre2_set_method[] = {
+    { "first",      _lpcre2_set_first },
+    { "match",      _lpcre2_set_match },
+    { "size",       _lpcre2_set_size },
+    { NULL,         NULL },
+};
+
+static const luaL_Reg s_lpcre2_match_context_meta[] = {
+    { "__gc",       _lpcre2_match_context_gc },
+    { NULL,         NULL },
+};
+
+static const luaL_Reg s_lpcre2_stream_meta[] = {
+    { "__gc",       _lpcre2_stream_gc },
+    { NULL,         NULL },
+};
+
+static const luaL_Reg s_lpcre2_stream_method[] = {
+    { "feed",       _lpcre2_stream_feed },
+    { "finish",     _lpcre2_stream_finish },
+    { NULL,         NULL },
+};
+
+static const luaL_Reg s_lpcre2_buffer_meta[] = {
+    { "__gc",       _lpcre2_buffer_gc },
+    { "__len",      _lpcre2_buffer_len },
+    { NULL,         NULL },
+};
+
+static const luaL_Reg s_lpcre2_buffer_method[] = {
+    { "close",      _lpcre2_buffer_close_method },
+    { NULL,         NULL },
+};
+
+static const luaL_Reg s_lpcre2_parallel_meta[] = {
+    { "__gc",       _lpcre2_parallel_gc },
+    { NULL,         NULL },
+};
+
+static const luaL_Reg* const s_lpcre2_type_funcs[LPCRE2_TYPE_MAX][2] = {
+    { s_lpcre2_code_meta,               s_lpcre2_code_method },
+    { s_lpcre2_match_data_meta,         s_lpcre2_match_data_method },
+    { s_lpcre2_match_data_iter_meta,    NULL },
+    { s_lpcre2_set_meta,                s_lpcre2_set_method },
+    { s_lpcre2_match_context_meta,      NULL },
+    { s_lpcre2_stream_meta,             s_lpcre2_stream_method },
+    { s_lpcre2_buffer_meta,             s_lpcre2_buffer_method },
+    { s_lpcre2_parallel_meta,           NULL },
+};
+
+static void _lpcre2_new_metatable(lua_State* L, lpcre2_type_t type)
+{
+    const luaL_Reg* meta = s_lpcre2_type_funcs[type][0];
+    const luaL_Reg* method = s_lpcre2_type_funcs[type][1];
+
+    luaL_newmetatable(L, s_lpcre2_type_names[type]);
+
+    /* upvalue: metatable */
+    lua_pushvalue(L, -1);
+    luaL_setfuncs(L, meta, 1);
+
+    if (method != NULL)
+    {
+        /* metatable.__index = method */
+        lua_createtable(L, 0, 0);
+        lua_pushvalue(L, -2);
+        luaL_setfuncs(L, method, 1);
+        lua_setfield(L, -2, "__index");
+    }
+
+    lua_pushlightuserdata(L, (void*)&s_lpcre2_type_keys[type]);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
@@ -0,0 +1,165 @@
+#include "test.h"
+#include <stdlib.h>
+
+typedef struct test_allocator
+{
+	lua_State*	L;
+	size_t		used;	/**< Bytes in use. */
+	size_t		allocs;	/**< Number of allocations. */
+	size_t		limit;	/**< Max bytes in use, 0 for no limit. */
+} test_allocator_t;
+
+static test_allocator_t g_test_allocator;
+
+static void* _test_allocator_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+	test_allocator_t* allocator = ud;
+	size_t old_size = ptr != NULL ? osize : 0;
+
+	if (nsize == 0)
+	{
+		allocator->used -= old_size;
+		free(ptr);
+		return NULL;
+	}
+
+	if (allocator->limit != 0 && nsize > old_size
+		&& allocator->used + (nsize - old_size) > allocator->limit)
+	{
+		return NULL;
+	}
+
+	void* new_ptr = realloc(ptr, nsize);
+	if (new_ptr != NULL)
+	{
+		allocator->used = allocator->used - old_size + nsize;
+		allocator->allocs += ptr == NULL;
+	}
+	return new_ptr;
+}
+
+static int _test_allocator_set_limit(lua_State* L)
+{
+	size_t extra = (size_t)luaL_checkinteger(L, 1);
+	g_test_allocator.limit = extra != 0 ? g_test_allocator.used + extra : 0;
+	return 0;
+}
+
+static int _test_allocator_stats(lua_State* L)
+{
+	lua_pushinteger(L, (lua_Integer)g_test_allocator.used);
+	lua_pushinteger(L, (lua_Integer)g_test_allocator.allocs);
+	return 2;
+}
+
+TEST_FIXTURE_SETUP(allocator)
+{
+	memset(&g_test_allocator, 0, sizeof(g_test_allocator));
+
+	g_test_allocator.L = lua_newstate(_test_allocator_alloc, &g_test_allocator);
+	ASSERT_NE_PTR(g_test_allocator.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_allocator.L), 1);
+	lua_setglobal(g_test_allocator.L, "lpcre2");
+	luaL_openlibs(g_test_allocator.L);
+
+	lua_pushcfunction(g_test_allocator.L, _test_allocator_set_limit);
+	lua_setglobal(g_test_allocator.L, "set_limit");
+
+	lua_pushcfunction(g_test_allocator.L, _test_allocator_stats);
+	lua_setglobal(g_test_allocator.L, "alloc_stats");
+}
+
+TEST_FIXTURE_TEARDOWN(allocator)
+{
+	lua_close(g_test_allocator.L);
+	g_test_allocator.L = NULL;
+
+	/* Everything must be returned to the Lua allocator. */
+	ASSERT_EQ_SIZE(g_test_allocator.used, 0);
+}
+
+TEST_F(allocator, limit)
+{
+	const char* lua_code =
+"local pattern = string.rep(\"abc\", 5000)" LF
+"set_limit(16 * 1024)" LF
+"local ret = pcall(lpcre2.compile, pattern, 0, 0)" LF
+"set_limit(0)" LF
+"assert(ret == false)" LF
+LF
+"local code = lpcre2.compile(pattern, 0, 0)" LF
+"assert(code:match(pattern) ~= nil)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_allocator.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_allocator.L, -1));
+}
+
+TEST_F(allocator, release)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\w+)\\\\s(\\\\w+)\")" LF
+"assert(code:match_captures(\"hello world\") == \"hello\")" LF
+"for a, b in code:gmatch(\"a b c d\") do end" LF
+"assert(code:gsub(\"a b\", \"%2 %1\") == \"b a\")" LF
+"code:set_match_context(lpcre2.match_context({ jit_stack = { 32 * 1024, 64 * 1024 } }))" LF
+"assert(code:match(\"hello world\"):group(\"hello world\", 1) == \"hello\")" LF
+"local codes = lpcre2.deserialize(lpcre2.serialize({ code }))" LF
+"assert(codes[1]:match_captures(\"hello world\") == \"hello\")" LF
+"assert(lpcre2.set({ \"a\", \"b\" }):first(\"b\") == 2)" LF
+LF
+"-- nothing is leaked when loading runs out of memory half way" LF
+"local named = lpcre2.compile(\"(?<x>a)(?<y>b)\", 0, 0)" LF
+"local bytes = lpcre2.serialize({ named, named, named })" LF
+"for extra = 1, 64 * 1024, 8 do" LF
+"    collectgarbage()" LF
+"    set_limit(extra)" LF
+"    local ok = pcall(lpcre2.deserialize, bytes)" LF
+"    set_limit(0)" LF
+"    if ok then break end" LF
+"end" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_allocator.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_allocator.L, -1));
+}
+
+TEST_F(allocator, inline_match_data)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(a)(b)(c)\", 0, 0)" LF
+"local subject = \"xabc\"" LF
+LF
+"local function round()" LF
+"    collectgarbage()" LF
+"    collectgarbage(\"stop\")" LF
+LF
+"    -- the PCRE2 match data is placed inside the userdata" LF
+"    local _, allocs = alloc_stats()" LF
+"    local md = code:new_match_data()" LF
+"    local _, md_allocs = alloc_stats()" LF
+"    assert(md_allocs == allocs + 1, md_allocs - allocs)" LF
+LF
+"    assert(code:match(subject, 0, 0, md) == md)" LF
+"    assert(md:group(subject, 3) == \"c\")" LF
+LF
+"    md = nil" LF
+"    collectgarbage(\"restart\")" LF
+"    collectgarbage()" LF
+"    collectgarbage()" LF
+"    return (alloc_stats())" LF
+"end" LF
+LF
+"-- heap frames of the interpreter are released with it, so memory in" LF
+"-- use does not grow with the number of match data objects" LF
+"local used = round()" LF
+"for _ = 1, 100 do" LF
+"    round()" LF
+"end" LF
+"assert(round() - used < 4096)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_allocator.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_allocator.L, -1));
+}
@@ -0,0 +1,77 @@
+#include "test.h"
+
+typedef struct test_buffer
+{
+	lua_State* L;
+} test_buffer_t;
+
+static test_buffer_t g_test_buffer;
+
+TEST_FIXTURE_SETUP(buffer)
+{
+	memset(&g_test_buffer, 0, sizeof(g_test_buffer));
+
+	g_test_buffer.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_buffer.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_buffer.L), 1);
+	lua_setglobal(g_test_buffer.L, "lpcre2");
+	luaL_openlibs(g_test_buffer.L);
+}
+
+TEST_FIXTURE_TEARDOWN(buffer)
+{
+	lua_close(g_test_buffer.L);
+	g_test_buffer.L = NULL;
+}
+
+TEST_F(buffer, mapfile)
+{
+	const char* lua_code =
+"local path = os.tmpname()" LF
+"local file = assert(io.open(path, \"wb\"))" LF
+"file:write(\"id=1 name=foo\\nid=22 name=bar\\n\")" LF
+"file:close()" LF
+LF
+"local buf = lpcre2.mapfile(path)" LF
+"assert(#buf == 29)" LF
+"local code = lpcre2.compile(\"id=(\\\\d+)\")" LF
+"assert(code:match_captures(buf) == \"1\")" LF
+"assert(select(3, code:match_offsets(buf, 5)) == 18)" LF
+"assert(code:match(buf):group(buf, 1) == \"1\")" LF
+LF
+"local ids = {}" LF
+"for id in code:gmatch(buf) do ids[#ids + 1] = id end" LF
+"assert(#ids == 2 and ids[2] == \"22\")" LF
+LF
+"buf:close()" LF
+"assert(pcall(code.match, code, buf) == false)" LF
+"os.remove(path)" LF
+LF
+"assert(pcall(lpcre2.mapfile, path) == false)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_buffer.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_buffer.L, -1));
+}
+
+TEST_F(buffer, external)
+{
+	static const char data[] = "hello world";
+	lua_pushlightuserdata(g_test_buffer.L, (void*)data);
+	lua_setglobal(g_test_buffer.L, "data");
+
+	const char* lua_code =
+"local buf = lpcre2.buffer(data, 11)" LF
+"local code = lpcre2.compile(\"o\")" LF
+"local beg = code:match_offsets(buf, 5)" LF
+"assert(beg == 8)" LF
+"assert(lpcre2.compile(\"(\\\\w+)$\"):match_captures(buf) == \"world\")" LF
+"assert(pcall(lpcre2.buffer, data, -1) == false)" LF
+"assert(pcall(lpcre2.buffer, \"hello\", 5) == false)" LF
+"assert(#lpcre2.buffer(data, 0) == 0)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_buffer.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_buffer.L, -1));
+}
@@ -0,0 +1,95 @@
+#include "test.h"
+
+typedef struct test_cache
+{
+	lua_State* L;
+} test_cache_t;
+
+static test_cache_t g_test_cache;
+
+TEST_FIXTURE_SETUP(cache)
+{
+	memset(&g_test_cache, 0, sizeof(g_test_cache));
+
+	g_test_cache.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_cache.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_cache.L), 1);
+	lua_setglobal(g_test_cache.L, "lpcre2");
+	luaL_openlibs(g_test_cache.L);
+}
+
+TEST_FIXTURE_TEARDOWN(cache)
+{
+	lua_close(g_test_cache.L);
+	g_test_cache.L = NULL;
+}
+
+TEST_F(cache, disabled)
+{
+	const char* lua_code =
+"assert(lpcre2.cache_size() == 0)" LF
+"assert(lpcre2.compile(\"a\") ~= lpcre2.compile(\"a\"))" LF
+"assert(lpcre2.cache_stats().misses == 0)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_cache.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_cache.L, -1));
+}
+
+TEST_F(cache, lru)
+{
+	const char* lua_code =
+"assert(lpcre2.cache_size(2) == 2)" LF
+LF
+"local a = lpcre2.compile(\"a\")" LF
+"assert(lpcre2.compile(\"a\") == a)" LF
+"assert(lpcre2.compile(\"a\", lpcre2.PCRE2_DOTALL) ~= a)" LF
+"assert(lpcre2.compile(\"a\", 0, 0) ~= a)" LF
+LF
+"local stats = lpcre2.cache_stats()" LF
+"assert(stats.size == 2)" LF
+"assert(stats.hits == 1)" LF
+"assert(stats.misses == 3)" LF
+"assert(stats.evictions == 1)" LF
+LF
+"local b = lpcre2.compile(\"b\")" LF
+"assert(lpcre2.compile(\"b\") == b)" LF
+"local c = lpcre2.compile(\"c\")" LF
+"assert(lpcre2.compile(\"b\") == b)" LF
+"assert(lpcre2.compile(\"c\") == c)" LF
+"assert(lpcre2.cache_stats().size == 2)" LF
+LF
+"lpcre2.cache_size(1)" LF
+"assert(lpcre2.compile(\"c\") == c)" LF
+"assert(lpcre2.compile(\"b\") ~= b)" LF
+"assert(pcall(lpcre2.compile, \"(\") == false)" LF
+"assert(lpcre2.cache_stats().size == 1)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_cache.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_cache.L, -1));
+}
+
+TEST_F(cache, keep_state)
+{
+	const char* lua_code =
+"assert(lpcre2.cache_size(4) == 4)" LF
+"local content = string.rep(\"a\", 12) .. \"b\"" LF
+LF
+"local code = lpcre2.compile(\"(a+)+$\")" LF
+"code:set_match_context(lpcre2.match_context({ match_limit = 100 }))" LF
+"assert(code:match(\"aaa\") ~= nil)" LF
+LF
+"for _ = 1, 3 do" LF
+"    assert(lpcre2.compile(\"(a+)+$\") == code)" LF
+"    local ret, errcode = code:match(content)" LF
+"    assert(ret == false and errcode == lpcre2.PCRE2_ERROR_MATCHLIMIT, errcode)" LF
+"    assert(code:dfa_match(\"aaa\") ~= nil)" LF
+"end" LF
+"assert(lpcre2.cache_stats().hits == 3)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_cache.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_cache.L, -1));
+}
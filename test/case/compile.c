@@ -42,3 +42,53 @@ TEST_F(lpcre2, compile)
 	/* Verify result */
 	ASSERT_EQ_INT(lua_type(g_test_compile.L, -1), LUA_TUSERDATA);
 }
+
+static int _test_compile_prefix(lua_State* L)
+{
+	/* Only the first 3 bytes are the pattern. */
+	lpcre2_compile(L, "a(bc)", 3, 0);
+	return 1;
+}
+
+TEST_F(lpcre2, compile_error_length)
+{
+	lua_pushcfunction(g_test_compile.L, _test_compile_prefix);
+	ASSERT_NE_INT(lua_pcall(g_test_compile.L, 0, 1, 0), LUA_OK);
+	ASSERT_EQ_STR(lua_tostring(g_test_compile.L, -1),
+		"compile pattern `a(b` error at 3: missing closing parenthesis");
+}
+
+TEST_F(lpcre2, raise_errors)
+{
+	const char* lua_code =
+"assert(lpcre2.raise_errors() == true)" LF
+"assert(pcall(lpcre2.compile, \"a(b\") == false)" LF
+LF
+"assert(lpcre2.raise_errors(false) == false)" LF
+"local code, errcode, message = lpcre2.compile(\"a(b\")" LF
+"assert(code == nil and errcode == 114)" LF
+"assert(message == \"compile pattern `a(b` error at 3: missing closing parenthesis\")" LF
+"code, errcode = lpcre2.compile_shared(\"x[\")" LF
+"assert(code == nil and errcode == 106)" LF
+LF
+"code = lpcre2.compile(\"(*UTF)a\")" LF
+"local ret, errcode = code:match(\"\\255\")" LF
+"assert(ret == nil and errcode == -23)" LF
+"ret, errcode = code:match(\"a\", 10)" LF
+"assert(ret == nil and errcode == lpcre2.PCRE2_ERROR_BADOFFSET)" LF
+"assert(code:match(\"b\") == nil)" LF
+"assert(code:match(\"a\") ~= nil)" LF
+"ret, errcode = code:substitute(\"a\", \"$9\")" LF
+"assert(ret == nil and errcode == lpcre2.PCRE2_ERROR_NOSUBSTRING)" LF
+"assert(code:substitute(\"a\", \"b\") == \"b\")" LF
+LF
+"assert(lpcre2.raise_errors(true) == true)" LF
+"assert(pcall(code.match, code, \"\\255\") == false)" LF
+;
+
+	lua_setglobal(g_test_compile.L, "lpcre2");
+	luaL_openlibs(g_test_compile.L);
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_compile.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_compile.L, -1));
+}
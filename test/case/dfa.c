@@ -0,0 +1,69 @@
+#include "test.h"
+
+typedef struct test_dfa
+{
+	lua_State* L;
+} test_dfa_t;
+
+static test_dfa_t g_test_dfa;
+
+TEST_FIXTURE_SETUP(dfa)
+{
+	memset(&g_test_dfa, 0, sizeof(g_test_dfa));
+
+	g_test_dfa.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_dfa.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_dfa.L), 1);
+	lua_setglobal(g_test_dfa.L, "lpcre2");
+	luaL_openlibs(g_test_dfa.L);
+}
+
+TEST_FIXTURE_TEARDOWN(dfa)
+{
+	lua_close(g_test_dfa.L);
+	g_test_dfa.L = NULL;
+}
+
+TEST_F(dfa, match)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"a|ab|abc\")" LF
+"local ret = { code:dfa_match(\"xabcd\") }" LF
+"assert(#ret == 4)" LF
+"assert(ret[1] == 2 and ret[2] == 4 and ret[3] == 3 and ret[4] == 2)" LF
+LF
+"ret = { code:dfa_match(\"xabcd\", 0, lpcre2.PCRE2_DFA_SHORTEST) }" LF
+"assert(#ret == 2 and ret[1] == 2 and ret[2] == 2)" LF
+LF
+"assert(code:dfa_match(\"xyz\") == nil)" LF
+"assert(code:dfa_match(\"abc\", 1) == nil)" LF
+LF
+"-- More matches than the initial match data holds." LF
+"code = lpcre2.compile(\"a*?\")" LF
+"ret = { code:dfa_match(string.rep(\"a\", 40)) }" LF
+"assert(#ret == 42 and ret[1] == 1 and ret[2] == 40 and ret[42] == 0)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_dfa.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_dfa.L, -1));
+}
+
+TEST_F(dfa, restart)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"abc(def)+\")" LF
+"local partial = lpcre2.PCRE2_PARTIAL_HARD" LF
+"local restart = partial + lpcre2.PCRE2_DFA_RESTART" LF
+LF
+"local ret, errcode = code:dfa_match(\"xxab\", 0, partial)" LF
+"assert(ret == false and errcode == lpcre2.PCRE2_ERROR_PARTIAL)" LF
+"ret, errcode = code:dfa_match(\"cde\", 0, restart)" LF
+"assert(ret == false and errcode == lpcre2.PCRE2_ERROR_PARTIAL)" LF
+"ret = { code:dfa_match(\"fdefx\", 0, restart) }" LF
+"assert(#ret == 3 and ret[2] == 4 and ret[3] == 1, #ret)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_dfa.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_dfa.L, -1));
+}
@@ -0,0 +1,80 @@
+#include "test.h"
+
+typedef struct test_gmatch
+{
+	lua_State* L;
+} test_gmatch_t;
+
+static test_gmatch_t g_test_gmatch;
+
+TEST_FIXTURE_SETUP(gmatch)
+{
+	memset(&g_test_gmatch, 0, sizeof(g_test_gmatch));
+
+	g_test_gmatch.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_gmatch.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_gmatch.L), 1);
+	lua_setglobal(g_test_gmatch.L, "lpcre2");
+	luaL_openlibs(g_test_gmatch.L);
+}
+
+TEST_FIXTURE_TEARDOWN(gmatch)
+{
+	lua_close(g_test_gmatch.L);
+	g_test_gmatch.L = NULL;
+}
+
+TEST_F(gmatch, captures)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\w+)=(\\\\w+)\")" LF
+"local res = {}" LF
+"for k, v in code:gmatch(\"a=1, b=2, c=3\") do" LF
+"    res[#res + 1] = k .. v" LF
+"end" LF
+"assert(#res == 3)" LF
+"assert(res[1] == \"a1\" and res[2] == \"b2\" and res[3] == \"c3\")" LF
+LF
+"local n = 0" LF
+"for k in code:gmatch(\"a=1, b=2, c=3\", 5) do" LF
+"    n = n + 1" LF
+"end" LF
+"assert(n == 2)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_gmatch.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_gmatch.L, -1));
+}
+
+TEST_F(gmatch, empty_match)
+{
+	const char* lua_code =
+"local res = {}" LF
+"for m in lpcre2.compile(\"x*\"):gmatch(\"axxb\") do" LF
+"    res[#res + 1] = m" LF
+"end" LF
+"assert(table.concat(res, \",\") == \",xx,,\")" LF
+LF
+"local n = 0" LF
+"for m in lpcre2.compile(\"(*CRLF)\"):gmatch(\"a\\r\\nb\") do" LF
+"    n = n + 1" LF
+"end" LF
+"assert(n == 4)" LF
+LF
+"n = 0" LF
+"for m in lpcre2.compile(\"(*UTF)\"):gmatch(\"\\195\\169\\195\\169\") do" LF
+"    n = n + 1" LF
+"end" LF
+"assert(n == 3)" LF
+LF
+"local res = {}" LF
+"for a, b in lpcre2.compile(\"(a)|(b)\"):gmatch(\"ab\") do" LF
+"    res[#res + 1] = tostring(a) .. tostring(b)" LF
+"end" LF
+"assert(res[1] == \"afalse\" and res[2] == \"falseb\")" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_gmatch.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_gmatch.L, -1));
+}
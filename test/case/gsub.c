@@ -0,0 +1,90 @@
+#include "test.h"
+
+typedef struct test_gsub
+{
+	lua_State* L;
+} test_gsub_t;
+
+static test_gsub_t g_test_gsub;
+
+TEST_FIXTURE_SETUP(gsub)
+{
+	memset(&g_test_gsub, 0, sizeof(g_test_gsub));
+
+	g_test_gsub.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_gsub.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_gsub.L), 1);
+	lua_setglobal(g_test_gsub.L, "lpcre2");
+	luaL_openlibs(g_test_gsub.L);
+}
+
+TEST_FIXTURE_TEARDOWN(gsub)
+{
+	lua_close(g_test_gsub.L);
+	g_test_gsub.L = NULL;
+}
+
+TEST_F(gsub, string)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\w+)=(\\\\w+)\")" LF
+"local ret, n = code:gsub(\"a=1, b=2\", \"%2=%1 (%0) 100%%\")" LF
+"assert(ret == \"1=a (a=1) 100%, 2=b (b=2) 100%\")" LF
+"assert(n == 2)" LF
+LF
+"ret, n = code:gsub(\"a=1, b=2\", \"x\", 1)" LF
+"assert(ret == \"x, b=2\" and n == 1)" LF
+LF
+"ret, n = lpcre2.compile(\"x*\"):gsub(\"abc\", \"-\")" LF
+"assert(ret == \"-a-b-c-\" and n == 4)" LF
+LF
+"assert(pcall(code.gsub, code, \"a=1\", \"%x\") == false)" LF
+"assert(pcall(code.gsub, code, \"a=1\", \"%3\") == false)" LF
+LF
+"-- without groups, %1 is the whole match like string.gsub()" LF
+"ret, n = lpcre2.compile(\"\\\\d+\"):gsub(\"a1 b22\", \"<%1>\")" LF
+"assert(ret == \"a<1> b<22>\" and n == 2)" LF
+"assert(ret == (\"a1 b22\"):gsub(\"%d+\", \"<%1>\"))" LF
+"assert(pcall(lpcre2.compile(\"\\\\d+\").gsub, lpcre2.compile(\"\\\\d+\"), \"a1\", \"%2\") == false)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_gsub.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_gsub.L, -1));
+}
+
+TEST_F(gsub, table)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"\\\\$(\\\\w+)\")" LF
+"local env = { user = \"root\", home = \"/root\" }" LF
+"local ret, n = code:gsub(\"$user at $home, $unknown\", env)" LF
+"assert(ret == \"root at /root, $unknown\")" LF
+"assert(n == 3)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_gsub.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_gsub.L, -1));
+}
+
+TEST_F(gsub, function)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\d+)\\\\+(\\\\d+)\")" LF
+"local ret = code:gsub(\"1+2, 3+4\", function(a, b)" LF
+"    return tonumber(a) + tonumber(b)" LF
+"end)" LF
+"assert(ret == \"3, 7\")" LF
+LF
+"ret = lpcre2.compile(\"\\\\w+\"):gsub(\"hello world\", function(w)" LF
+"    if w == \"world\" then return false end" LF
+"    return w:upper()" LF
+"end)" LF
+"assert(ret == \"HELLO world\")" LF
+LF
+"assert(pcall(code.gsub, code, \"1+2\", function() return {} end) == false)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_gsub.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_gsub.L, -1));
+}
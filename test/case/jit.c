@@ -0,0 +1,65 @@
+#include "test.h"
+
+typedef struct test_jit
+{
+	lua_State* L;
+} test_jit_t;
+
+static test_jit_t g_test_jit;
+
+TEST_FIXTURE_SETUP(jit)
+{
+	memset(&g_test_jit, 0, sizeof(g_test_jit));
+
+	g_test_jit.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_jit.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_jit.L), 1);
+	lua_setglobal(g_test_jit.L, "lpcre2");
+	luaL_openlibs(g_test_jit.L);
+}
+
+TEST_FIXTURE_TEARDOWN(jit)
+{
+	lua_close(g_test_jit.L);
+	g_test_jit.L = NULL;
+}
+
+TEST_F(jit, disable)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\d+)\", 0, 0)" LF
+"local info = code:info()" LF
+"assert(info.jit == false)" LF
+"assert(info.jit_options == 0)" LF
+"assert(info.jit_size == 0)" LF
+LF
+"local match = code:match(\"abc 123\")" LF
+"assert(match:group(\"abc 123\", 1) == \"123\")" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_jit.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_jit.L, -1));
+}
+
+TEST_F(jit, match)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\d+)\")" LF
+"local info = code:info()" LF
+"if info.jit then" LF
+"    assert(info.jit_options == lpcre2.PCRE2_JIT_COMPLETE)" LF
+"    assert(info.jit_size > 0)" LF
+"end" LF
+LF
+"local content = \"abc 123 456\"" LF
+"assert(code:match(content):group(content, 1) == \"123\")" LF
+"assert(code:match(content, 7):group(content, 1) == \"456\")" LF
+"assert(code:match(content, 11) == nil)" LF
+"assert(code:match(content, 0, lpcre2.PCRE2_ANCHORED) == nil)" LF
+"assert(pcall(code.match, code, content, 100) == false)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_jit.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_jit.L, -1));
+}
@@ -53,3 +53,212 @@ LF
 	ASSERT_EQ_INT(luaL_dostring(g_test_match.L, lua_code), LUA_OK,
 		"%s", lua_tostring(g_test_match.L, -1));
 }
+
+TEST_F(code, match_reuse_match_data)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\w+) (\\\\w+)\")" LF
+"local md = code:new_match_data()" LF
+"assert(md:group_count() == -1)" LF
+LF
+"local content = \"hello world!\"" LF
+"assert(code:match(content, 0, 0, md) == md)" LF
+"assert(md:group(content, 1) == \"hello\")" LF
+"assert(md:group(content, 2) == \"world\")" LF
+LF
+"content = \"foo bar\"" LF
+"assert(code:match(content, 0, 0, md) == md)" LF
+"assert(md:group(content, 1) == \"foo\")" LF
+LF
+"assert(code:match(\"nomatch\", 0, 0, md) == nil)" LF
+"assert(md:group_count() == -1)" LF
+LF
+"local small = lpcre2.compile(\"x\"):new_match_data()" LF
+"assert(pcall(code.match, code, content, 0, 0, small) == false)" LF
+;
+
+	lua_setglobal(g_test_match.L, "lpcre2");
+	luaL_openlibs(g_test_match.L);
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_match.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_match.L, -1));
+}
+
+TEST_F(code, match_captures)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\w+) (\\\\w+)(!)?\")" LF
+"local a, b, c = code:match_captures(\"hello world\")" LF
+"assert(a == \"hello\" and b == \"world\" and c == false)" LF
+"assert(code:match_captures(\"hello\") == nil)" LF
+"assert(lpcre2.compile(\"\\\\w+\"):match_captures(\"hello world\", 5) == \"world\")" LF
+LF
+"local t = { [4] = \"keep\" }" LF
+"assert(code:match_captures(\"foo bar!\", 0, 0, t) == t)" LF
+"assert(t[0] == \"foo bar!\" and t[1] == \"foo\" and t[2] == \"bar\" and t[3] == \"!\")" LF
+"assert(t[4] == \"keep\")" LF
+;
+
+	lua_setglobal(g_test_match.L, "lpcre2");
+	luaL_openlibs(g_test_match.L);
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_match.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_match.L, -1));
+}
+
+TEST_F(code, match_offsets)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\w+) (\\\\w+)(!)?\")" LF
+"local content = \"say hello world\"" LF
+"local s0, e0, s1, e1, s2, e2, s3, e3 = code:match_offsets(content, 4)" LF
+"assert(string.sub(content, s0, e0) == \"hello world\")" LF
+"assert(string.sub(content, s1, e1) == \"hello\")" LF
+"assert(string.sub(content, s2, e2) == \"world\")" LF
+"assert(s3 == false and e3 == false)" LF
+"assert(code:match_offsets(\"hello\") == nil)" LF
+;
+
+	lua_setglobal(g_test_match.L, "lpcre2");
+	luaL_openlibs(g_test_match.L);
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_match.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_match.L, -1));
+}
+
+TEST_F(code, match_many)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\w+)=(\\\\d+)?\")" LF
+"local rows = { \"a=1\", \"nothing\", \"b=\", \"c=3\" }" LF
+"local ret = code:match_many(rows)" LF
+"assert(#ret == 3 and ret[1] == 1 and ret[2] == 3 and ret[3] == 4)" LF
+LF
+"ret = code:match_many(rows, 0, true)" LF
+"assert(#ret == 4)" LF
+"assert(ret[1][0] == \"a=1\" and ret[1][1] == \"a\" and ret[1][2] == \"1\")" LF
+"assert(ret[2] == false)" LF
+"assert(ret[3][1] == \"b\" and ret[3][2] == false)" LF
+"assert(ret[4][2] == \"3\")" LF
+LF
+"assert(#code:match_many({}) == 0)" LF
+"assert(pcall(code.match_many, code, { \"a=1\", 2, {} }) == false)" LF
+;
+
+	lua_setglobal(g_test_match.L, "lpcre2");
+	luaL_openlibs(g_test_match.L);
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_match.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_match.L, -1));
+}
+
+TEST_F(code, match_info)
+{
+	const char* lua_code =
+"local info = lpcre2.compile(\"(?<key>\\\\w+)=(?<value>\\\\d+)(x)?\"):info()" LF
+"assert(info.capture_count == 3)" LF
+"assert(info.names.key == 1 and info.names.value == 2)" LF
+"assert(info.min_length == 3)" LF
+"assert(info.first_unit == nil and info.last_unit == \"=\")" LF
+"assert(info.literal == nil)" LF
+LF
+"assert(lpcre2.compile(\"^hello world\"):info().literal == \"hello world\")" LF
+"assert(lpcre2.compile(\"abc?d\"):info().literal == \"ab\")" LF
+"assert(lpcre2.compile(\"a\\\\.b\\\\d\"):info().literal == \"a.b\")" LF
+"assert(lpcre2.compile(\"foo+bar\"):info().literal == \"foo\")" LF
+"assert(lpcre2.compile(\"foo(bar)?\"):info().literal == \"foo\")" LF
+"assert(lpcre2.compile(\"foo\\124bar\"):info().literal == nil)" LF
+"assert(lpcre2.compile(\"(?i)foo\"):info().literal == nil)" LF
+"assert(#lpcre2.compile(\"x\"):info().names == 0)" LF
+;
+
+	lua_setglobal(g_test_match.L, "lpcre2");
+	luaL_openlibs(g_test_match.L);
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_match.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_match.L, -1));
+}
+
+TEST_F(code, match_prefilter)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"hello (\\\\w+)\")" LF
+"local content = \"say hello world\"" LF
+"assert(code:match(content):group(content, 1) == \"world\")" LF
+"assert(code:match(\"say hello\") == nil)" LF
+"local b0, e0, b1, e1 = code:match_offsets(content)" LF
+"assert(b0 == 5 and e0 == 15 and b1 == 11 and e1 == 15)" LF
+"assert(code:match(content, 6) == nil)" LF
+"assert(code:count(\"hello a, hello b, hell c\") == 2)" LF
+"assert(code:match(\"hello a\", 0, lpcre2.PCRE2_ANCHORED) ~= nil)" LF
+"assert(code:match(\"xhello a\", 0, lpcre2.PCRE2_ANCHORED) == nil)" LF
+"assert(lpcre2.compile(\"^ab\", lpcre2.PCRE2_MULTILINE):match(\"x\\nab\") ~= nil)" LF
+"assert(lpcre2.compile(\"^ab\"):match(\"x\\nab\") == nil)" LF
+LF
+"-- partial matches may end before the literal" LF
+"assert(pcall(code.match, code, \"say hel\", 0, lpcre2.PCRE2_PARTIAL_HARD) == false)" LF
+"local stream = code:stream()" LF
+"assert(#stream:feed(\"say hel\") == 0)" LF
+"local ret = stream:feed(\"lo world \")" LF
+"assert(#ret == 1 and ret[1][0] == \"hello world\")" LF
+LF
+"-- invalid UTF is still reported" LF
+"local utf = lpcre2.compile(\"(*UTF)abc\")" LF
+"assert(pcall(utf.match, utf, \"\\255zz\") == false)" LF
+LF
+"-- FIRSTLINE is relative to the start offset" LF
+"local firstline = lpcre2.compile(\"abc\", 0x100)" LF
+"assert(firstline:match(\"x\\nabc\") == nil)" LF
+"assert(firstline:match(\"x\\nabc\", 2) ~= nil)" LF
+"assert(firstline:match(\"xabc\\n\") ~= nil)" LF
+LF
+"-- NO_START_OPTIMIZE leaves every start position to PCRE2" LF
+"local nso = lpcre2.compile(\"hello (\\\\w+)\", 0x10000)" LF
+"assert(nso:match(content):group(content, 1) == \"world\")" LF
+"assert(nso:match(\"say hello\") == nil)" LF
+;
+
+	lua_setglobal(g_test_match.L, "lpcre2");
+	luaL_openlibs(g_test_match.L);
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_match.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_match.L, -1));
+}
+
+TEST_F(code, match_named)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(?<year>\\\\d{4})-(?<month>\\\\d\\\\d)(?:-(?<day>\\\\d\\\\d))?\")" LF
+"assert(code:group_index(\"year\") == 1 and code:group_index(\"day\") == 3)" LF
+"assert(code:group_index(\"nope\") == nil)" LF
+LF
+"local content = \"on 2024-05 ok\"" LF
+"local md = code:match(content)" LF
+"assert(md:named(content, \"year\") == \"2024\")" LF
+"assert(md:named(content, \"month\") == \"05\")" LF
+"assert(md:named(content, \"day\") == nil)" LF
+"assert(pcall(md.named, md, content, \"nope\") == false)" LF
+LF
+"local all = md:all_groups(content, true)" LF
+"assert(all[1] == \"2024\" and all.year == \"2024\" and all.month == \"05\" and all.day == nil)" LF
+"assert(md:all_groups(content).year == nil)" LF
+LF
+"-- duplicate names resolve to the first set group" LF
+"local dup = lpcre2.compile(\"(?J)(?<n>a)x\\124(?<n>b)y\")" LF
+"local a, b = dup:group_index(\"n\")" LF
+"assert(a == 1 and b == 2)" LF
+"assert(dup:match(\"by\"):named(\"by\", \"n\") == \"b\")" LF
+"assert(dup:match(\"ax\"):all_groups(\"ax\", true).n == \"a\")" LF
+LF
+"-- match data keep the names of the code they were matched by" LF
+"md = lpcre2.compile(\"(?<k>\\\\w+)=\"):match(\"key=\")" LF
+"collectgarbage()" LF
+"assert(md:named(\"key=\", \"k\") == \"key\")" LF
+;
+
+	lua_setglobal(g_test_match.L, "lpcre2");
+	luaL_openlibs(g_test_match.L);
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_match.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_match.L, -1));
+}
@@ -0,0 +1,93 @@
+#include "test.h"
+
+typedef struct test_match_context
+{
+	lua_State* L;
+} test_match_context_t;
+
+static test_match_context_t g_test_match_context;
+
+TEST_FIXTURE_SETUP(match_context)
+{
+	memset(&g_test_match_context, 0, sizeof(g_test_match_context));
+
+	g_test_match_context.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_match_context.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_match_context.L), 1);
+	lua_setglobal(g_test_match_context.L, "lpcre2");
+	luaL_openlibs(g_test_match_context.L);
+}
+
+TEST_FIXTURE_TEARDOWN(match_context)
+{
+	lua_close(g_test_match_context.L);
+	g_test_match_context.L = NULL;
+}
+
+TEST_F(match_context, match_limit)
+{
+	const char* lua_code =
+"local ctx = lpcre2.match_context({ match_limit = 100 })" LF
+"local content = string.rep(\"a\", 30) .. \"b\"" LF
+LF
+"for _, jit in ipairs({ 0, lpcre2.PCRE2_JIT_COMPLETE }) do" LF
+"    local code = lpcre2.compile(\"(a+)+$\", 0, jit)" LF
+"    assert(code:match(\"aaa\", 0, 0, nil, ctx) ~= nil)" LF
+LF
+"    local ret, errcode, msg = code:match(content, 0, 0, nil, ctx)" LF
+"    assert(ret == false)" LF
+"    assert(errcode == lpcre2.PCRE2_ERROR_MATCHLIMIT, errcode)" LF
+"    assert(type(msg) == \"string\")" LF
+LF
+"    code:set_match_context(ctx)" LF
+"    local md = code:new_match_data()" LF
+"    ret, errcode = code:match(content, 0, 0, md)" LF
+"    assert(ret == false and errcode == lpcre2.PCRE2_ERROR_MATCHLIMIT)" LF
+"    assert(md:group_count() == errcode)" LF
+LF
+"    -- every match path reports the limit the same way" LF
+"    local function limited(ret, errcode, msg)" LF
+"        return ret == false and errcode == lpcre2.PCRE2_ERROR_MATCHLIMIT" LF
+"            and type(msg) == \"string\"" LF
+"    end" LF
+"    assert(limited(code:match_captures(content)))" LF
+"    assert(limited(code:match_offsets(content)))" LF
+"    assert(limited(code:count(content)))" LF
+"    assert(limited(code:split(content)))" LF
+"    assert(limited(code:gsub(content, \"x\")))" LF
+"    assert(limited(code:match_many({ \"aaa\", content })))" LF
+"    assert(limited(code:substitute(content, \"x\")))" LF
+"    assert(limited(code:substitute_many({ \"aaa\", content }, \"x\")))" LF
+"    assert(pcall(code:gmatch(content)) == false)" LF
+LF
+"    code:set_match_context(nil)" LF
+"    assert(code:match(\"aaab\") == nil)" LF
+"end" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_match_context.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_match_context.L, -1));
+}
+
+TEST_F(match_context, jit_stack)
+{
+	const char* lua_code =
+"local ctx = lpcre2.match_context({" LF
+"    depth_limit = 10000," LF
+"    heap_limit = 1024," LF
+"    jit_stack = { 32 * 1024, 1024 * 1024 }," LF
+"})" LF
+"local code = lpcre2.compile(\"(\\\\w+)\\\\s(\\\\w+)\")" LF
+"code:set_match_context(ctx)" LF
+"ctx = nil" LF
+"collectgarbage()" LF
+"assert(code:match_captures(\"hello world\") == \"hello\")" LF
+LF
+"assert(pcall(lpcre2.match_context, { match_limit = -1 }) == false)" LF
+"assert(pcall(lpcre2.match_context, { jit_stack = { 2, 1 } }) == false)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_match_context.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_match_context.L, -1));
+}
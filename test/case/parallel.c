@@ -0,0 +1,93 @@
+#include "test.h"
+
+typedef struct test_parallel
+{
+	lua_State* L;
+} test_parallel_t;
+
+static test_parallel_t g_test_parallel;
+
+TEST_FIXTURE_SETUP(parallel)
+{
+	memset(&g_test_parallel, 0, sizeof(g_test_parallel));
+
+	g_test_parallel.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_parallel.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_parallel.L), 1);
+	lua_setglobal(g_test_parallel.L, "lpcre2");
+	luaL_openlibs(g_test_parallel.L);
+}
+
+TEST_FIXTURE_TEARDOWN(parallel)
+{
+	lua_close(g_test_parallel.L);
+	g_test_parallel.L = NULL;
+}
+
+TEST_F(parallel, count_all)
+{
+	const char* lua_code =
+"local lines = {}" LF
+"for i = 1, 50000 do lines[i] = \"line \" .. i .. \" id=\" .. (i * 7919 % 1000) end" LF
+"local subject = table.concat(lines, \"\\n\")" LF
+LF
+"for _, pattern in ipairs({ \"id=(\\\\d+)\", \"^line \\\\d+5 \", \"\\\\d+$\", \"\\\\d*\" }) do" LF
+"    local code = lpcre2.compile(pattern, lpcre2.PCRE2_MULTILINE)" LF
+"    local expect = 0" LF
+"    for _ in code:gmatch(subject) do expect = expect + 1 end" LF
+LF
+"    local offsets = code:find_all(subject, { threads = 1 })" LF
+"    for _, threads in ipairs({ 1, 3, 8 }) do" LF
+"        assert(code:count_all(subject, { threads = threads }) == expect)" LF
+"        local ret = code:find_all(subject, { threads = threads })" LF
+"        assert(#ret == 2 * expect)" LF
+"        for i = 1, #ret do assert(ret[i] == offsets[i]) end" LF
+"    end" LF
+"end" LF
+LF
+"local code = lpcre2.compile(\"id=\\\\d+\")" LF
+"local ret = code:find_all(subject)" LF
+"assert(subject:sub(ret[1], ret[2]) == \"id=919\")" LF
+"assert(code:count_all(\"\") == 0)" LF
+LF
+"-- assertions see past the end of a partition" LF
+"local pad = string.rep(\"x\", 70000)" LF
+"subject = pad .. \"foo\\n\" .. pad .. \"\\n\" .. pad" LF
+"for _, pattern in ipairs({ \"foo\\\\Z\", \"foo(?=\\\\nx)\", \"foo\\\\n(?=x)\", \"x$\", \"x\\\\z\" }) do" LF
+"    code = lpcre2.compile(pattern, lpcre2.PCRE2_MULTILINE)" LF
+"    local expect = 0" LF
+"    for _ in code:gmatch(subject) do expect = expect + 1 end" LF
+"    assert(code:count_all(subject, { threads = 3 }) == expect, pattern)" LF
+"    assert(#code:find_all(subject, { threads = 3 }) == 2 * expect, pattern)" LF
+"end" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_parallel.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_parallel.L, -1));
+}
+
+TEST_F(parallel, split)
+{
+	const char* lua_code =
+"local subject = string.rep(\"abc;\", 100000)" LF
+"local code = lpcre2.compile(\"c;a\")" LF
+"assert(code:count_all(subject, { threads = 4 }) == 99999)" LF
+"-- a match is found by the partition where it starts" LF
+"assert(code:count_all(subject, { threads = 4, split = \";\" }) == 99999)" LF
+"assert(lpcre2.compile(\"b\"):count_all(subject, { threads = 4, split = \";\" }) == 100000)" LF
+"assert(pcall(code.count_all, code, subject, { split = \"\" }) == false)" LF
+"assert(pcall(code.count_all, code, subject, { threads = 0 }) == false)" LF
+LF
+"code = lpcre2.compile(\"(a+)+$\")" LF
+"code:set_match_context(lpcre2.match_context({ match_limit = 100, jit_stack = { 32 * 1024, 64 * 1024 } }))" LF
+"subject = string.rep(string.rep(\"a\", 30) .. \"b\\n\", 10000)" LF
+"local ret, errcode = code:count_all(subject, { threads = 4 })" LF
+"assert(ret == false and errcode == lpcre2.PCRE2_ERROR_MATCHLIMIT)" LF
+"ret, errcode = code:find_all(subject, { threads = 4 })" LF
+"assert(ret == false and errcode == lpcre2.PCRE2_ERROR_MATCHLIMIT)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_parallel.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_parallel.L, -1));
+}
@@ -0,0 +1,69 @@
+#include "test.h"
+
+typedef struct test_serialize
+{
+	lua_State* L;
+} test_serialize_t;
+
+static test_serialize_t g_test_serialize;
+
+TEST_FIXTURE_SETUP(serialize)
+{
+	memset(&g_test_serialize, 0, sizeof(g_test_serialize));
+
+	g_test_serialize.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_serialize.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_serialize.L), 1);
+	lua_setglobal(g_test_serialize.L, "lpcre2");
+	luaL_openlibs(g_test_serialize.L);
+}
+
+TEST_FIXTURE_TEARDOWN(serialize)
+{
+	lua_close(g_test_serialize.L);
+	g_test_serialize.L = NULL;
+}
+
+TEST_F(serialize, roundtrip)
+{
+	const char* lua_code =
+"local codes = {" LF
+"    lpcre2.compile(\"(\\\\w+)@(\\\\w+)\")," LF
+"    lpcre2.compile(\"^get\", lpcre2.PCRE2_MULTILINE, 0)," LF
+"}" LF
+"local bytes = lpcre2.serialize(codes)" LF
+"assert(type(bytes) == \"string\")" LF
+LF
+"local loaded = lpcre2.deserialize(bytes)" LF
+"assert(#loaded == 2)" LF
+"assert(loaded[1]:info().jit == codes[1]:info().jit)" LF
+"assert(loaded[2]:info().jit == false)" LF
+LF
+"local a, b = loaded[1]:match_captures(\"mail: foo@bar\")" LF
+"assert(a == \"foo\" and b == \"bar\")" LF
+"assert(loaded[2]:match(\"post\\nget\") ~= nil)" LF
+LF
+"-- the literal prefilter is kept" LF
+"local literal = lpcre2.compile(\"hello (\\\\w+)\")" LF
+"loaded = lpcre2.deserialize(lpcre2.serialize({ literal }))[1]" LF
+"assert(loaded:info().literal == \"hello \")" LF
+"assert(loaded:match_captures(\"say hello world\") == \"world\")" LF
+LF
+"assert(#lpcre2.deserialize(lpcre2.serialize({})) == 0)" LF
+"assert(pcall(lpcre2.deserialize, \"garbage\") == false)" LF
+"assert(pcall(lpcre2.deserialize, string.sub(bytes, 1, 16)) == false)" LF
+"assert(pcall(lpcre2.deserialize, bytes:sub(1, -2)) == false)" LF
+"assert(pcall(lpcre2.deserialize, bytes:sub(1, math.floor(#bytes / 2))) == false)" LF
+"assert(pcall(lpcre2.deserialize, bytes .. \"\\0\") == false)" LF
+LF
+"local jit = bytes:sub(1, 16) .. \"\\255\\255\\255\\255\" .. bytes:sub(21)" LF
+"assert(#jit == #bytes)" LF
+"assert(pcall(lpcre2.deserialize, jit) == false)" LF
+"local long = bytes:sub(1, 20) .. \"\\255\\0\\0\\0\" .. bytes:sub(25)" LF
+"assert(pcall(lpcre2.deserialize, long) == false)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_serialize.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_serialize.L, -1));
+}
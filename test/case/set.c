@@ -0,0 +1,67 @@
+#include "test.h"
+
+typedef struct test_set
+{
+	lua_State* L;
+} test_set_t;
+
+static test_set_t g_test_set;
+
+TEST_FIXTURE_SETUP(set)
+{
+	memset(&g_test_set, 0, sizeof(g_test_set));
+
+	g_test_set.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_set.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_set.L), 1);
+	lua_setglobal(g_test_set.L, "lpcre2");
+	luaL_openlibs(g_test_set.L);
+}
+
+TEST_FIXTURE_TEARDOWN(set)
+{
+	lua_close(g_test_set.L);
+	g_test_set.L = NULL;
+}
+
+TEST_F(set, match)
+{
+	const char* lua_code =
+"local set = lpcre2.set({" LF
+"    \"ERROR\"," LF
+"    \"(?i)warn\"," LF
+"    \"GET /api/\\\\w+\"," LF
+"    \"\\\\d{3}$\"," LF
+"    \"^$\"," LF
+"})" LF
+"assert(set:size() == 5)" LF
+LF
+"local res = set:match(\"WARN: GET /api/users 200\")" LF
+"assert(#res == 3 and res[1] == 2 and res[2] == 3 and res[3] == 4)" LF
+"assert(set:first(\"WARN: GET /api/users 200\") == 2)" LF
+LF
+"res = set:match(\"nothing here\")" LF
+"assert(#res == 0)" LF
+"assert(set:first(\"nothing here\") == nil)" LF
+"assert(set:first(\"\") == 5)" LF
+"assert(set:first(\"an ERROR\") == 1)" LF
+"assert(set:first(\"an ERROR\", 4) == nil)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_set.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_set.L, -1));
+}
+
+TEST_F(set, error)
+{
+	const char* lua_code =
+"local ok, err = pcall(lpcre2.set, { \"a\", \"(\" })" LF
+"assert(ok == false and string.find(err, \"pattern 2\"))" LF
+"assert(pcall(lpcre2.set, { \"a\", {} }) == false)" LF
+"assert(lpcre2.set({}):first(\"a\") == nil)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_set.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_set.L, -1));
+}
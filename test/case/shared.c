@@ -0,0 +1,83 @@
+#include "test.h"
+
+typedef struct test_shared
+{
+	lua_State* L1;
+	lua_State* L2;
+} test_shared_t;
+
+static test_shared_t g_test_shared;
+
+static lua_State* _test_shared_newstate(void)
+{
+	lua_State* L = luaL_newstate();
+	ASSERT_NE_PTR(L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(L), 1);
+	lua_setglobal(L, "lpcre2");
+	luaL_openlibs(L);
+
+	return L;
+}
+
+TEST_FIXTURE_SETUP(shared)
+{
+	memset(&g_test_shared, 0, sizeof(g_test_shared));
+
+	g_test_shared.L1 = _test_shared_newstate();
+	g_test_shared.L2 = _test_shared_newstate();
+}
+
+TEST_FIXTURE_TEARDOWN(shared)
+{
+	if (g_test_shared.L1 != NULL)
+	{
+		lua_close(g_test_shared.L1);
+		g_test_shared.L1 = NULL;
+	}
+	if (g_test_shared.L2 != NULL)
+	{
+		lua_close(g_test_shared.L2);
+		g_test_shared.L2 = NULL;
+	}
+}
+
+TEST_F(shared, states)
+{
+	const char* lua_code =
+"code = lpcre2.compile_shared(\"(b+)c\")" LF
+"assert(code:match(\"abbc\"):group(\"abbc\", 1) == \"bb\")" LF
+;
+	ASSERT_EQ_INT(luaL_dostring(g_test_shared.L1, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_shared.L1, -1));
+	ASSERT_EQ_INT(luaL_dostring(g_test_shared.L2, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_shared.L2, -1));
+
+	const char* check_code =
+"local stats = lpcre2.shared_stats()" LF
+"assert(stats.size == 1, stats.size)" LF
+"assert(stats.references == 2, stats.references)" LF
+"local other = lpcre2.compile_shared(\"(b+)c\", 0, 0)" LF
+"assert(lpcre2.shared_stats().size == 2)" LF
+"other = nil" LF
+"collectgarbage()" LF
+"assert(lpcre2.shared_stats().size == 1)" LF
+"assert(pcall(lpcre2.compile_shared, \"(\") == false)" LF
+;
+	ASSERT_EQ_INT(luaL_dostring(g_test_shared.L1, check_code), LUA_OK,
+		"%s", lua_tostring(g_test_shared.L1, -1));
+
+	/* The code outlives the state that compiled it. */
+	lua_close(g_test_shared.L1);
+	g_test_shared.L1 = NULL;
+
+	const char* after_code =
+"assert(lpcre2.shared_stats().references == 1)" LF
+"assert(code:match(\"abbbc\"):group(\"abbbc\", 1) == \"bbb\")" LF
+"code = nil" LF
+"collectgarbage()" LF
+"assert(lpcre2.shared_stats().size == 0)" LF
+;
+	ASSERT_EQ_INT(luaL_dostring(g_test_shared.L2, after_code), LUA_OK,
+		"%s", lua_tostring(g_test_shared.L2, -1));
+}
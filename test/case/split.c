@@ -0,0 +1,64 @@
+#include "test.h"
+
+typedef struct test_split
+{
+	lua_State* L;
+} test_split_t;
+
+static test_split_t g_test_split;
+
+TEST_FIXTURE_SETUP(split)
+{
+	memset(&g_test_split, 0, sizeof(g_test_split));
+
+	g_test_split.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_split.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_split.L), 1);
+	lua_setglobal(g_test_split.L, "lpcre2");
+	luaL_openlibs(g_test_split.L);
+}
+
+TEST_FIXTURE_TEARDOWN(split)
+{
+	lua_close(g_test_split.L);
+	g_test_split.L = NULL;
+}
+
+TEST_F(split, split)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"\\\\s*,\\\\s*\")" LF
+"local t = code:split(\"a , b,c,, d\")" LF
+"assert(#t == 5)" LF
+"assert(t[1] == \"a\" and t[2] == \"b\" and t[3] == \"c\" and t[4] == \"\" and t[5] == \"d\")" LF
+LF
+"t = code:split(\"a,b,c\", 1)" LF
+"assert(#t == 2 and t[1] == \"a\" and t[2] == \"b,c\")" LF
+"t = code:split(\"a,b\", 0)" LF
+"assert(#t == 1 and t[1] == \"a,b\")" LF
+"t = code:split(\"\")" LF
+"assert(#t == 1 and t[1] == \"\")" LF
+LF
+"t = lpcre2.compile(\"x*\"):split(\"abc\")" LF
+"assert(table.concat(t, \"|\") == \"|a|b|c|\")" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_split.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_split.L, -1));
+}
+
+TEST_F(split, count)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"\\\\d+\")" LF
+"assert(code:count(\"a1 b22 c333\") == 3)" LF
+"assert(code:count(\"a1 b22 c333\", 3) == 2)" LF
+"assert(code:count(\"none\") == 0)" LF
+"assert(lpcre2.compile(\"\"):count(\"abc\") == 4)" LF
+"assert(lpcre2.compile(\"x*\", 0, 0):count(\"axxb\") == 4)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_split.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_split.L, -1));
+}
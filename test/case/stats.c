@@ -0,0 +1,95 @@
+#include "test.h"
+
+typedef struct test_stats
+{
+	lua_State* L;
+} test_stats_t;
+
+static test_stats_t g_test_stats;
+
+TEST_FIXTURE_SETUP(stats)
+{
+	memset(&g_test_stats, 0, sizeof(g_test_stats));
+
+	g_test_stats.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_stats.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_stats.L), 1);
+	lua_setglobal(g_test_stats.L, "lpcre2");
+	luaL_openlibs(g_test_stats.L);
+}
+
+TEST_FIXTURE_TEARDOWN(stats)
+{
+	lua_close(g_test_stats.L);
+	g_test_stats.L = NULL;
+}
+
+TEST_F(stats, counters)
+{
+	const char* lua_code =
+"local plain = lpcre2.compile(\"a\")" LF
+"assert(plain:stats() == nil)" LF
+LF
+"lpcre2.instrument(true)" LF
+"local code = lpcre2.compile(\"(b+)\")" LF
+"assert(code:match(\"abbc\"))" LF
+"assert(code:match(\"xyz\") == nil)" LF
+"assert(code:match_captures(\"bb\") == \"bb\")" LF
+"for _ in code:gmatch(\"b-b-b\") do end" LF
+"assert(code:substitute(\"abc\", \"x\") == \"axc\")" LF
+"-- worker threads do not update the counters" LF
+"assert(code:count_all(\"\") == 0 and code:count_all(\"bb\") == 1)" LF
+LF
+"local s = code:stats()" LF
+"assert(s.calls == 8, s.calls)" LF
+"assert(s.hits == 6, s.hits)" LF
+"assert(s.misses == 2, s.misses)" LF
+"assert(s.errors == 0)" LF
+"assert(s.bytes == 4 + 3 + 2 + (5 + 4 + 2 + 0) + 3, s.bytes)" LF
+"assert(s.max_time <= s.total_time)" LF
+"local n = 0" LF
+"for _, v in ipairs(s.histogram) do n = n + v end" LF
+"assert(n == s.calls)" LF
+LF
+"local other = lpcre2.compile(\"[a-c]z\")" LF
+"local long = string.rep(\"x\", 100000)" LF
+"for _ = 1, 20 do other:match(long) end" LF
+"local all = lpcre2.stats()" LF
+"assert(#all == 2)" LF
+"assert(all[1].code == other)" LF
+"assert(all[2].code == code)" LF
+LF
+"lpcre2.instrument(false)" LF
+"code:match(\"b\")" LF
+"assert(code:stats().calls == 8)" LF
+"assert(lpcre2.compile(\"d\"):stats() == nil)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_stats.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_stats.L, -1));
+}
+
+TEST_F(stats, slow)
+{
+	const char* lua_code =
+"local reports = {}" LF
+"lpcre2.instrument({ slow_threshold = 1e-9, on_slow = function(code, seconds, length)" LF
+"    reports[#reports + 1] = { code = code, seconds = seconds, length = length }" LF
+"    assert(code:match_captures(\"zz\") == \"zz\")" LF
+"end })" LF
+"local code = lpcre2.compile(\"(z+)\")" LF
+"assert(code:match_offsets(\"azzz\") == 2)" LF
+"assert(#reports == 1)" LF
+"assert(reports[1].code == code)" LF
+"assert(reports[1].seconds > 0)" LF
+"assert(reports[1].length == 4)" LF
+LF
+"lpcre2.instrument({ on_slow = function() error(\"boom\") end, slow_threshold = 1e-9 })" LF
+"local ok, err = pcall(code.match, code, \"z\")" LF
+"assert(not ok and err:find(\"boom\"))" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_stats.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_stats.L, -1));
+}
@@ -0,0 +1,88 @@
+#include "test.h"
+
+typedef struct test_stream
+{
+	lua_State* L;
+} test_stream_t;
+
+static test_stream_t g_test_stream;
+
+TEST_FIXTURE_SETUP(stream)
+{
+	memset(&g_test_stream, 0, sizeof(g_test_stream));
+
+	g_test_stream.L = luaL_newstate();
+	ASSERT_NE_PTR(g_test_stream.L, NULL);
+
+	ASSERT_EQ_INT(luaopen_lpcre2(g_test_stream.L), 1);
+	lua_setglobal(g_test_stream.L, "lpcre2");
+	luaL_openlibs(g_test_stream.L);
+}
+
+TEST_FIXTURE_TEARDOWN(stream)
+{
+	lua_close(g_test_stream.L);
+	g_test_stream.L = NULL;
+}
+
+TEST_F(stream, feed)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\d+)-(\\\\d+)\")" LF
+"local stream = code:stream()" LF
+LF
+"local ret = stream:feed(\"ab 12\")" LF
+"assert(#ret == 0)" LF
+"ret = stream:feed(\"3-4\")" LF
+"assert(#ret == 0)" LF
+"ret = stream:feed(\"5 c 6-7 d 8\")" LF
+"assert(#ret == 2)" LF
+"assert(ret[1][0] == \"123-45\")" LF
+"assert(ret[1][1] == 4 and ret[1][2] == 9)" LF
+"assert(ret[1][3] == 4 and ret[1][4] == 6)" LF
+"assert(ret[1][5] == 8 and ret[1][6] == 9)" LF
+"assert(ret[2][0] == \"6-7\" and ret[2][1] == 13 and ret[2][2] == 15)" LF
+LF
+"ret = stream:feed(\"-9\")" LF
+"assert(#ret == 0)" LF
+"ret = stream:finish()" LF
+"assert(#ret == 1 and ret[1][0] == \"8-9\" and ret[1][1] == 19)" LF
+"assert(pcall(stream.feed, stream, \"1-2\") == false)" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_stream.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_stream.L, -1));
+}
+
+TEST_F(stream, lookbehind)
+{
+	const char* lua_code =
+"local subject = \"foo foobar xfoo foo\" .. string.rep(\" \", 100) .. \"barfoo\"" LF
+"local code = lpcre2.compile(\"(?<=bar)foo|\\\\bfoo\\\\b\")" LF
+"local expect = {}" LF
+"local offset = 0" LF
+"while true do" LF
+"    local beg, fin = code:match_offsets(subject, offset)" LF
+"    if beg == nil then break end" LF
+"    expect[#expect + 1] = beg .. \"-\" .. fin" LF
+"    offset = fin" LF
+"end" LF
+"assert(#expect == 3)" LF
+LF
+"for size = 1, 7 do" LF
+"    local stream = code:stream()" LF
+"    local got = {}" LF
+"    local function collect(ret)" LF
+"        for _, m in ipairs(ret) do got[#got + 1] = m[1] .. \"-\" .. m[2] end" LF
+"    end" LF
+"    for pos = 1, #subject, size do" LF
+"        collect(stream:feed(subject:sub(pos, pos + size - 1)))" LF
+"    end" LF
+"    collect(stream:finish())" LF
+"    assert(table.concat(got, \",\") == table.concat(expect, \",\"), size)" LF
+"end" LF
+;
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_stream.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_stream.L, -1));
+}
@@ -86,3 +86,43 @@ TEST_F(code, substitute_lua)
 	ASSERT_EQ_INT(luaL_dostring(g_test_substitute.L, lua_code), LUA_OK,
 		"%s", lua_tostring(g_test_substitute.L, -1));
 }
+
+TEST_F(code, substitute_overflow)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"a\")" LF
+"local content = string.rep(\"a\", 10000)" LF
+"local ret = code:substitute(content, \"bbb\", lpcre2.PCRE2_SUBSTITUTE_GLOBAL)" LF
+"assert(ret == string.rep(\"bbb\", 10000))" LF
+LF
+"ret = code:substitute(content, \"\", lpcre2.PCRE2_SUBSTITUTE_GLOBAL)" LF
+"assert(ret == \"\")" LF
+LF
+"assert(code:substitute(\"xyz\", \"b\") == \"xyz\")" LF
+"assert(code:substitute(\"xaz\", \"b\") == \"xbz\")" LF
+;
+
+	lua_setglobal(g_test_substitute.L, "lpcre2");
+	luaL_openlibs(g_test_substitute.L);
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_substitute.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_substitute.L, -1));
+}
+
+TEST_F(code, substitute_many)
+{
+	const char* lua_code =
+"local code = lpcre2.compile(\"(\\\\d+)\")" LF
+"local ret = code:substitute_many({ \"a1b22\", \"none\", \"3\" }, \"<$1>\", lpcre2.PCRE2_SUBSTITUTE_GLOBAL)" LF
+"assert(#ret == 3)" LF
+"assert(ret[1] == \"a<1>b<22>\" and ret[2] == \"none\" and ret[3] == \"<3>\")" LF
+"ret = code:substitute_many({ \"a1b22\" }, \"x\")" LF
+"assert(ret[1] == \"axb22\")" LF
+;
+
+	lua_setglobal(g_test_substitute.L, "lpcre2");
+	luaL_openlibs(g_test_substitute.L);
+
+	ASSERT_EQ_INT(luaL_dostring(g_test_substitute.L, lua_code), LUA_OK,
+		"%s", lua_tostring(g_test_substitute.L, -1));
+}